@@ -1,9 +1,35 @@
 #include <stdint.h>
 #include <stdio.h>
-
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dlfcn.h>
+
+// Build with -DDEBUG=0 for speed (fuzzing, benchmarks)
+#ifndef DEBUG
 #define DEBUG 1
+#endif
 
 #define MEMORY_SIZE 0x100000            // 1MB of memory
+#define SECTOR_SIZE 512                 // Bytes per disk sector
+#define READAHEAD_SECTORS 64            // How far ahead to prefetch on sequential reads
+#define DISKETTE_TABLE_SEGMENT 0xF000   // Diskette parameter table at F000:EFC7 like the IBM BIOS
+#define DISKETTE_TABLE_OFFSET 0xEFC7
+#define ENTRY_BUDGET 100000000        // Instructions to reach --entry before we give up
+#define AOT_PAGE_SHIFT 8                // Translated code is watched for writes in 256 byte pages
+#define SNAPSHOT_PAGE_SHIFT 12          // Memory is restored from a snapshot in 4KB pages
+#define COVERAGE_MAP_SIZE 0x10000       // Edge coverage bitmap (64KB like AFL)
+#define FUZZ_BUFFER 0x8000              // Where test cases go unless --fuzz-buffer says (0000:8000)
+#define FUZZ_MAX_INPUT 0x1000           // Largest test case we'll generate
+#define FUZZ_BUDGET 100000              // Instructions per run before we call it a hang
+#define FUZZ_QUEUE_SIZE 1024            // Inputs kept because they found new edges
+#define CONFORMANCE_AOT_TEMPLATES 64    // Instructions per opcode translated for the conformance AOT leg
 
 // FLAGS defines
 #define FLAG_CF 0x0001                  // Carry flag
@@ -13,6 +39,24 @@
 
 uint8_t memory[MEMORY_SIZE];            // create an array to store our 1MB of RAM
 
+// A disk image attached to one of the BIOS drives
+// The image is mmap'ed privately so the file itself is never written:
+// guest writes land in copy-on-write pages owned by this process, which
+// lets many emulators share the same image read-only
+typedef struct
+{
+    uint8_t *data;          // mapped image (NULL if no disk attached)
+    size_t size;            // size of the image in bytes
+    uint16_t cylinders;
+    uint8_t heads;
+    uint8_t sectors;        // sectors per track
+    uint8_t type;           // floppy drive type reported in BL by AH=08 (0 for hard disks)
+    uint32_t next_lba;      // sector after the last read, used to spot sequential reads
+    uint8_t *sector_saved;  // bitmap of sectors already in the snapshot undo log
+} Disk;
+
+Disk disks[2];                          // 0 = floppy (DL=0x00), 1 = hard disk (DL=0x80)
+
 typedef struct
 {
     int running;
@@ -44,6 +88,88 @@ typedef struct
     uint16_t FLAGS;
 } CPU16;
 
+// Instruction kinds as seen by the decoder
+#define INSN_NORMAL 0                   // falls through to the next instruction
+#define INSN_BRANCH 1                   // conditional jump: either the target or the next instruction
+#define INSN_JUMP 2                     // unconditional jump to the target
+#define INSN_CALL 3                     // call the target, comes back to the next instruction
+#define INSN_RETURN 4                   // return to an address popped off the stack
+#define INSN_HALT 5
+#define INSN_INTERRUPT 6                // BIOS services - only the interpreter runs these
+#define INSN_UNKNOWN 7
+
+// A decoded instruction
+typedef struct
+{
+    uint8_t opcode;
+    uint8_t length;     // total bytes including the opcode
+    uint8_t kind;       // one of the INSN_ kinds
+    uint16_t operand;   // immediate, memory offset, modrm byte or interrupt number
+    uint16_t target;    // IP of the jump or call target
+} Instruction;
+
+// Ahead-of-time translation
+// An AOT library holds one native function per guest basic block
+// Each function runs its block and leaves CS:IP pointing at whatever comes next
+typedef void (*AotFunction)(CPU16 *cpu);
+
+// One entry in the library's block table (must match what aot_translate emits)
+typedef struct
+{
+    uint16_t ip;
+    uint16_t length;
+    const uint8_t *bytes;   // the guest code the block was translated from
+    AotFunction function;
+} AotBlock;
+
+// The library's aot_bind: guest memory, the write helpers and the code written flag
+typedef void (*AotBind)(uint8_t *memory, void (*write8)(uint32_t, uint8_t), void (*write16)(uint32_t, uint16_t), uint8_t *code_written);
+
+AotFunction *aot_entry = NULL;          // translated block starting at each IP of aot_cs (NULL = interpret)
+uint16_t aot_cs = 0;                    // the code segment the library was translated for
+const AotBlock *aot_blocks = NULL;
+uint32_t aot_block_count = 0;
+uint8_t aot_code_page[MEMORY_SIZE >> AOT_PAGE_SHIFT];   // pages holding live translated code
+uint8_t aot_code_written = 0;           // set when a store hits translated code, running blocks check it
+
+// Snapshots
+// write8/write16 remember which pages have changed since the snapshot
+// so restoring only has to copy those back
+uint8_t snapshot_memory[MEMORY_SIZE];
+CPU16 snapshot_cpu;
+uint8_t page_dirty[MEMORY_SIZE >> SNAPSHOT_PAGE_SHIFT];
+uint32_t dirty_pages[MEMORY_SIZE >> SNAPSHOT_PAGE_SHIFT];
+uint32_t dirty_count = 0;
+
+// Disk sectors are saved the first time INT 13h writes them after a snapshot
+// so snapshot_restore can put the disks back too
+typedef struct
+{
+    Disk *disk;
+    uint32_t lba;
+    uint8_t data[SECTOR_SIZE];
+} SavedSector;
+
+int snapshot_taken = 0;
+uint32_t snapshot_next_lba[2];
+SavedSector *saved_sectors = NULL;
+uint32_t saved_count = 0;
+uint32_t saved_capacity = 0;
+
+// Edge coverage
+// Every branch, jump, call and return bumps the counter for the
+// (previous location, new location) pair like AFL does
+uint8_t coverage_map[COVERAGE_MAP_SIZE];
+uint16_t coverage_previous = 0;
+
+static inline void coverage_edge(CPU16 *cpu)
+{
+    uint32_t location = ((cpu->CS * 16 + cpu->IP) * 0x9E3779B1u) >> 16;
+
+    coverage_map[(location ^ coverage_previous) & (COVERAGE_MAP_SIZE - 1)]++;
+    coverage_previous = location >> 1;
+}
+
 // The Functions
 uint8_t read8(uint32_t address);
 void write8(uint32_t address, uint8_t value);
@@ -52,9 +178,28 @@ void write16(uint32_t address, uint16_t value);
 void push16(CPU16 *cpu, uint16_t value);
 uint16_t pop16(CPU16 *cpu);
 void debug_state(CPU16 *cpu, int show_stack);
+void execute_instruction(CPU16 *cpu);
+void usage(const char *program);
+int parse_address(const char *text, uint16_t *segment, uint16_t *offset);
+int run_until(CPU16 *cpu, uint16_t cs, uint16_t ip);
+int disk_attach(const char *path);
+Disk *disk_for_drive(uint8_t drive);
+void bios_disk(CPU16 *cpu);
+void decode_instruction(uint16_t cs, uint16_t ip, Instruction *insn);
+int aot_translate(const char *path, CPU16 *cpu);
+int aot_load(const char *path);
+void aot_invalidate(uint32_t address);
+void aot_invalidate_range(uint32_t address, uint32_t length);
+void snapshot_take(CPU16 *cpu);
+void snapshot_restore(CPU16 *cpu);
+void snapshot_mark_dirty(uint32_t address, uint32_t length);
+void snapshot_save_sector(Disk *disk, uint32_t lba);
+int fuzz(CPU16 *cpu, const char *seed_path, uint64_t runs, uint16_t buffer_segment, uint16_t buffer_offset);
+int conformance(uint64_t vectors);
+int conformance_replay(const char *line);
 
 // MAIN ////////////////////////////////////////
-int main()
+int main(int argc, char *argv[])
 {
     // Create a CPU and set all the registers to 0
     CPU16 cpu = {0};
@@ -67,6 +212,107 @@ int main()
     cpu.SS = 0x0000;
     cpu.SP = 0xFFFE;                    // top of the stack near end of the memory segment  
 
+    const char *images[2] = { NULL, NULL };
+    int image_count = 0;
+    const char *aot_emit = NULL;
+    const char *aot_library = NULL;
+    const char *fuzz_seed = NULL;
+    uint64_t fuzz_runs = 0;
+    uint16_t fuzz_segment = 0x0000, fuzz_offset = FUZZ_BUFFER;
+    uint64_t conformance_vectors = 0;
+    const char *replay = NULL;
+    const char *entry = NULL;
+    uint16_t entry_cs = 0, entry_ip = 0;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--aot-emit") == 0 && i + 1 < argc)
+        {
+            aot_emit = argv[++i];
+        }
+        else if(strcmp(argv[i], "--aot-load") == 0 && i + 1 < argc)
+        {
+            aot_library = argv[++i];
+        }
+        else if(strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc)
+        {
+            fuzz_seed = argv[++i];
+        }
+        else if(strcmp(argv[i], "--fuzz-runs") == 0 && i + 1 < argc)
+        {
+            fuzz_runs = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "--entry") == 0 && i + 1 < argc)
+        {
+            entry = argv[++i];
+
+            if(parse_address(entry, &entry_cs, &entry_ip) < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--fuzz-buffer") == 0 && i + 1 < argc)
+        {
+            if(parse_address(argv[++i], &fuzz_segment, &fuzz_offset) < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--conformance") == 0 && i + 1 < argc)
+        {
+            conformance_vectors = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            replay = argv[++i];
+        }
+        else if(argv[i][0] == '-' || image_count == 2)
+        {
+            // Unknown option, option without its value or too many images
+            usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            images[image_count++] = argv[i];
+        }
+    }
+
+    // Test modes that don't run a guest program
+    if(conformance_vectors > 0)
+    {
+        return conformance(conformance_vectors) == 0 ? 0 : 1;
+    }
+
+    if(replay != NULL)
+    {
+        return conformance_replay(replay) == 0 ? 0 : 1;
+    }
+
+    // Attach the disk images (floppy sizes go to drive 00, anything else to 80)
+    for(int i = 0; i < image_count; i++)
+    {
+        if(disk_attach(images[i]) < 0)
+        {
+            return 1;
+        }
+    }
+
+    // If we've been given a disk image then boot from it, floppy first:
+    // load the first sector to 0000:7C00 and jump there like the BIOS does
+    if(image_count > 0)
+    {
+        int drive = disk_for_drive(0x00) != NULL ? 0x00 : 0x80;
+
+        Disk *disk = disk_for_drive(drive);
+        memcpy(&memory[0x7C00], disk->data, SECTOR_SIZE);
+
+        cpu.IP = 0x7C00;
+        cpu.DX = drive;                 // DL = boot drive
+    }
+
     // Write our program to memory
     uint32_t address = 0x2000;
 
@@ -78,611 +324,675 @@ int main()
 
     // HLT
     write8(address++, 0xF4);
-   
+
+    // Let the guest get itself going first (e.g. a boot sector loading
+    // the rest of the program) so we translate what's really there
+    if(entry != NULL && run_until(&cpu, entry_cs, entry_ip) < 0)
+    {
+        return 1;
+    }
+
+    // Translate the program from its entry point instead of running it
+    if(aot_emit != NULL)
+    {
+        return aot_translate(aot_emit, &cpu) < 0 ? 1 : 0;
+    }
+
+    // Fuzz the program with everything set up so far (at --entry if given) as the starting state
+    if(fuzz_seed != NULL)
+    {
+        return fuzz(&cpu, fuzz_seed, fuzz_runs, fuzz_segment, fuzz_offset) < 0 ? 1 : 0;
+    }
+
+    if(aot_library != NULL && aot_load(aot_library) < 0)
+    {
+        return 1;
+    }
 
     // Fetch / Decode Loop
     while(cpu.running)
     {
-        // Step 1: Fetch
-        uint16_t physical_address = cpu.CS * 16 + cpu.IP;
-        uint8_t opcode = read8(physical_address);
-        cpu.IP++;               // move past the opcode
+        // Run a whole translated block if we have one for CS:IP,
+        // otherwise interpret a single instruction
+        AotFunction block = (aot_entry != NULL && cpu.CS == aot_cs) ? aot_entry[cpu.IP] : NULL;
 
-        // Step 2: Decode & Execute
-        switch(opcode)
+        if(block != NULL)
         {
-            // All the register MOV's
-            // AX, BX, CX, DX, SP, BP, SI & DI
-            case 0xB8: case 0xB9: case 0xBA: case 0xBB:
-            case 0xBC: case 0xBD: case 0xBE: case 0xBF:
-            {
-                // Fetch the next two bytes as immediate value
-                uint16_t value = read16(cpu.CS * 16 + cpu.IP);
-                cpu.IP += 2; 
+            aot_code_written = 0;
+            block(&cpu);
+        }
+        else
+        {
+            execute_instruction(&cpu);
+        }
 
-                switch(opcode)
-                {
-                    case 0xB8: cpu.AX = value; break;
-                    case 0xB9: cpu.CX = value; break;
-                    case 0xBA: cpu.DX = value; break;
-                    case 0xBB: cpu.BX = value; break;
-                    case 0xBC: cpu.SP = value; break;
-                    case 0xBD: cpu.BP = value; break;
-                    case 0xBE: cpu.SI = value; break;
-                    case 0xBF: cpu.DI = value; break;
-                }
-                #if DEBUG 
-                printf("Executed MOV reg, 0x%04X\n", value);
-                #endif
-                break;
+        debug_state(&cpu, 1);
+    }
+
+    return 0;
+}
+
+// Fetch, decode and execute a single instruction at CS:IP
+void execute_instruction(CPU16 *cpu)
+{
+    // Step 1: Fetch & Decode
+    // The same decoder the AOT translator uses, so the two always agree
+    // on how long an instruction is and what its operand is
+    Instruction insn;
+    decode_instruction(cpu->CS, cpu->IP, &insn);
+
+    uint8_t opcode = insn.opcode;
+    cpu->IP += insn.length;         // move past the whole instruction
+
+    // Step 2: Execute
+    switch(opcode)
+    {
+        // All the register MOV's
+        // AX, BX, CX, DX, SP, BP, SI & DI
+        case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+        case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+        {
+            // The immediate value
+            uint16_t value = insn.operand;
+
+            switch(opcode)
+            {
+                case 0xB8: cpu->AX = value; break;
+                case 0xB9: cpu->CX = value; break;
+                case 0xBA: cpu->DX = value; break;
+                case 0xBB: cpu->BX = value; break;
+                case 0xBC: cpu->SP = value; break;
+                case 0xBD: cpu->BP = value; break;
+                case 0xBE: cpu->SI = value; break;
+                case 0xBF: cpu->DI = value; break;
             }
+            #if DEBUG 
+            printf("Executed MOV reg, 0x%04X\n", value);
+            #endif
+            break;
+        }
+
+        // MOV AH, 8_bit_value
+        case 0xB4:
+        {
+            uint8_t imm = insn.operand;
+            cpu->AX = (imm << 8) | (cpu->AX & 0x00FF);    // keep AL
+            #if DEBUG
+            printf("Executed MOV AH, 0x%02X\n", imm);
+            #endif
+            break;
+        }
+
+        // MOV AL, 8_bit_value
+        case 0xB0:
+        {
+            uint8_t imm = insn.operand;
+            cpu->AX = (cpu->AX & 0xFF00) | imm;       // keep AH
+            #if DEBUG
+            printf("Exeecuted MOV AL, 0x%02X\n", imm);
+            #endif
+            break;
+        }
+
+        // MOV AX, [imm16]
+        case 0xA1:
+        {
+            uint16_t offset = insn.operand;
+
+            uint32_t address = cpu->DS * 16 + offset;
+
+            cpu->AX = read16(address);
+
+            #if DEBUG
+            printf("Exeecuted MOV AX, [0x%04X]\n", offset);
+            #endif
+
+            break;
+        }
+
+        // MOV [imm16], AX
+        case 0xA3:
+        {
+            uint16_t offset = insn.operand;
+
+            uint32_t address = cpu->DS * 16 + offset;
+            write16(address, cpu->AX);
+
+            #if DEBUG
+            printf("Exeecuted MOV [0x%04X], AX\n", offset);
+            #endif
+
+            break;
+        }
+
+        // MODRM (cheat)
+        // Put the value stored in BX into the AX register
+        case 0x8B:
+        {
+            uint8_t modrm_byte = insn.operand;
 
-            // MOV AH, 8_bit_value
-            case 0xB4:
+            // MOV AX, [BX]
+            if(modrm_byte == 0x07)
             {
-                uint8_t imm = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;
-                cpu.AX = (imm << 8) | (cpu.AX & 0x00FF);    // keep AL
+                uint32_t address = cpu->DS * 16 + cpu->BX;
+                cpu->AX = read16(address);
                 #if DEBUG
-                printf("Executed MOV AH, 0x%02X\n", imm);
+                printf("Executed MOV AX, [BX]\n");
                 #endif
-                break;
             }
+            #if DEBUG
+            else
+            {
+                printf("Unsupported 8B modrm: %02X\n", modrm_byte);
+            }
+            #endif
+
+            break;
+        }
+
+        case 0x89:
+        {
+            uint8_t modrm_byte = insn.operand;
 
-            // MOV AL, 8_bit_value
-            case 0xB0:
+            // MOV [BX], AX
+            if(modrm_byte == 0x07)
             {
-                uint8_t imm = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;
-                cpu.AX = (cpu.AX & 0xFF00) | imm;       // keep AH
+                uint32_t address = cpu->DS * 16 + cpu->BX;
+                write16(address, cpu->AX);
+
                 #if DEBUG
-                printf("Exeecuted MOV AL, 0x%02X\n", imm);
+                printf("Executed MOV [BX], AX\n");
                 #endif
-                break;
             }
-
-            // MOV AX, [imm16]
-            case 0xA1:
+            #if DEBUG
+            else
             {
-                uint16_t offset = read16(cpu.CS * 16 + cpu.IP);
-                cpu.IP += 2;
+                printf("Unsupported 89 modrm: %02X\n", modrm_byte);
+            }
+            #endif
+
+            break;
+        }
 
-                uint32_t address = cpu.DS * 16 + offset;
 
-                cpu.AX = read16(address);
+        // INT, 8_bit_value
+        case 0xCD:
+        {
+            uint8_t int_num = insn.operand;
 
+            if(int_num == 0x10 && (cpu->AX >> 8) == 0x0E) // AH = high byte of AX  
+            {
+                char c = cpu->AX & 0xFF;     // AL = low byte of AX
+                putchar(c);
+            }
+            else if(int_num == 0x13)
+            {
+                bios_disk(cpu);
+            }
+            else
+            {
                 #if DEBUG
-                printf("Exeecuted MOV AX, [0x%04X]\n", offset);
+                printf("\nUnknown interrupt 0x%02X with AH=0x%02X\n", int_num, cpu->AX >> 8);
                 #endif
-
-                break;
             }
+            break;
+        }
 
-            // MOV [imm16], AX
-            case 0xA3:
-            {
-                uint16_t offset = read16(cpu.CS * 16 + cpu.IP);
-                cpu.IP += 2;
+        // PUSH AX
+        case 0x50:
+        {
+            push16(cpu, cpu->AX);
+            #if DEBUG
+            printf("Executed PUSH AX\n");
+            #endif
+            break;
+        }
 
-                uint32_t address = cpu.DS * 16 + offset;
-                write16(address, cpu.AX);
+        // POP AX
+        case 0x58:
+        {
+            cpu->AX = pop16(cpu);
+            #if DEBUG
+            printf("Executed POP AX\n");
+            #endif
+            break;
+        }
 
-                #if DEBUG
-                printf("Exeecuted MOV [0x%04X], AX\n", offset);
-                #endif
+        // CALL rel16
+        case 0xE8:
+        {
+            // 1. The 16-bit relative offset (IP is already past it)
+            uint16_t offset = insn.operand;
 
-                break;
-            }
+            // 2. Push current IP (the return address)
+            push16(cpu, cpu->IP);
 
-            // MODRM (cheat)
-            // Put the value stored in BX into the AX register
-            case 0x8B:
-            {
-                uint8_t modrm_byte = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;
+            // 3. Jump to new address
+            cpu->IP += offset;
 
-                // MOV AX, [BX]
-                if(modrm_byte == 0x07)
-                {
-                    uint32_t address = cpu.DS * 16 + cpu.BX;
-                    cpu.AX = read16(address);
-                    #ifdef DEBUG
-                    printf("Executed MOV AX, [BX]\n");
-                    #endif
-                }
-                #ifdef DEBUG
-                else
-                {
-                    printf("Unsupported 8B modrm: %02X\n", modrm_byte);
-                }
-                #endif
+            #if DEBUG
+            printf("Exeecuted CALL 0x%04X\n", offset);
+            #endif
 
-                break;
-            }
+            coverage_edge(cpu);
+            break;
+        }
 
-            case 0x89:
-            {
-                uint8_t modrm_byte = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;
+        // RET
+        case 0xC3:
+        {
+            cpu->IP = pop16(cpu);
+            #if DEBUG
+            printf("Exeecuted RET\n");
+            #endif
 
-                // MOV [BX], AX
-                if(modrm_byte == 0x07)
-                {
-                    uint32_t address = cpu.DS * 16 + cpu.BX;
-                    write16(address, cpu.AX);
+            coverage_edge(cpu);
+            break;
+        }
 
-                    #ifdef DEBUG
-                    printf("Executed MOV [BX], AX\n");
-                    #endif
-                }
-                #ifdef DEBUG
-                else
-                {
-                    printf("Unsupported 89 modrm: %02X\n", modrm_byte);
-                }
-                #endif
+        // HLT
+        case 0xF4:
+        {
+            #if DEBUG
+            printf("CPU halted\n");
+            #endif
+            cpu->running = 0;
+            break;
+        }
 
-                break;
-            }
+        // CMP AX, imm16
+        case 0x3D:
+        {
+            uint16_t value = insn.operand;
 
+            uint32_t result = cpu->AX - value;
 
-            // INT, 8_bit_value
-            case 0xCD:
-            {
-                uint8_t int_num = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;
+            // Clear old flag values (only the ones we are using)
+            cpu->FLAGS &= ~(FLAG_CF | FLAG_ZF | FLAG_SF | FLAG_OF);
 
-                if(int_num == 0x10 && (cpu.AX >> 8) == 0x0E) // AH = high byte of AX  
-                {
-                    char c = cpu.AX & 0xFF;     // AL = low byte of AX
-                    putchar(c);
-                }
-                else
-                {
-                    #if DEBUG
-                    printf("\nUnknown interrupt 0x%02X with AH=0x%02X\n", int_num, cpu.AX >> 8);
-                    #endif
-                }
-                break;
+            // Zero flag
+            if((result & 0xFFFF) == 0)
+            {
+                cpu->FLAGS |= FLAG_ZF;
             }
 
-            // PUSH AX
-            case 0x50:
+            // Sign flag (bits 15 of 16-bit result)
+            if(result & 0x8000)
             {
-                push16(&cpu, cpu.AX);
-                #if DEBUG
-                printf("Executed PUSH AX\n");
-                #endif
-                break;
+                cpu->FLAGS |= FLAG_SF;
             }
 
-            // POP AX
-            case 0x58:
+            // Carry flag (borrow happened)
+            if(cpu->AX < value)
             {
-                cpu.AX = pop16(&cpu);
-                #if DEBUG
-                printf("Executed POP AX\n");
-                #endif
-                break;
+                cpu->FLAGS |= FLAG_CF;
             }
 
-            // CALL rel16
-            case 0xE8:
-            {
-                // 1. read 16-bit relative offset after opcode
-                uint16_t offset = read16(cpu.CS * 16 + cpu.IP);
-                cpu.IP += 2;    // move past the operand
+            // Overflow detection
+            uint16_t result16 = (uint16_t)result;
 
-                // 2. Push current IP (the return address)
-                push16(&cpu, cpu.IP);
+            if(((cpu->AX ^ value) & (cpu->AX ^ result16) & 0x8000)!= 0)
+            {
+                cpu->FLAGS |= FLAG_OF;
+            }
 
-                // 3. Jump to new address
-                cpu.IP += offset;
+            #if DEBUG
+            printf("Executed CMP AX, 0x%04X\n", value);
+            #endif
+            break;
+        }
 
-                #if DEBUG
-                printf("Exeecuted CALL 0x%04X\n", offset);
-                #endif
-                break;
-            }
+        // JE rel8
+        case 0x74:
+        {
+            int8_t offset = insn.operand;
 
-            // RET
-            case 0xC3:
+            if(cpu->FLAGS & FLAG_ZF)
             {
-                cpu.IP = pop16(&cpu);
+                cpu->IP += offset;
                 #if DEBUG
-                printf("Exeecuted RET\n");
+                printf("Executed JE (taken) %d\n", offset);
                 #endif
-                break;
             }
-
-            // HLT
-            case 0xF4:
+            else
             {
                 #if DEBUG
-                printf("CPU halted\n");
+                printf("Executed JE (not taken)\n");
                 #endif
-                cpu.running = 0;
-                break;
             }
 
-            // CMP AX, imm16
-            case 0x3D:
-            {
-                uint16_t value = read16(cpu.CS * 16 + cpu.IP);
-                cpu.IP += 2;            // Move past the number
-
-                uint32_t result = cpu.AX - value;
-
-                // Clear old flag values (only the ones we are using)
-                cpu.FLAGS &= ~(FLAG_CF | FLAG_ZF | FLAG_SF | FLAG_OF);
-
-                // Zero flag
-                if((result & 0xFFFF) == 0)
-                {
-                    cpu.FLAGS |= FLAG_ZF;
-                }
-
-                // Sign flag (bits 15 of 16-bit result)
-                if(result & 0x8000)
-                {
-                    cpu.FLAGS |= FLAG_SF;
-                }
+            coverage_edge(cpu);
+            break;
+        }
 
-                // Carry flag (borrow happened)
-                if(cpu.AX < value)
-                {
-                    cpu.FLAGS |= FLAG_CF;
-                }
+        // ADD AX, value
+        case 0x05:
+        {
+            uint16_t value = insn.operand;
 
-                // Overflow detection
-                uint16_t result16 = (uint16_t)result;
+            uint32_t result = cpu->AX + value;
 
-                if(((cpu.AX ^ value) & (cpu.AX ^ result16) & 0x8000)!= 0)
-                {
-                    cpu.FLAGS |= FLAG_OF;
-                }
+            // Clear the flags we care about
+            cpu->FLAGS &= ~(FLAG_CF | FLAG_ZF | FLAG_SF | FLAG_OF);
 
-                #ifdef DEBUG
-                printf("Executed CMP AX, 0x%04X\n", value);
-                #endif
-                break;
+            // Carry flag (unsigned overflow)
+            if(result > 0xFFFF)
+            {
+                cpu->FLAGS |= FLAG_CF;
             }
 
-            // JE rel8
-            case 0x74:
+            // Zero flag
+            if((result & 0xFFFF) == 0)
             {
-                int8_t offset = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;
-
-                if(cpu.FLAGS & FLAG_ZF)
-                {
-                    cpu.IP += offset;
-                    #ifdef DEBUG
-                    printf("Executed JE (taken) %d\n", offset);
-                    #endif
-                }
-                else
-                {
-                    #ifdef DEBUG
-                    printf("Executed JE (not taken)\n");
-                    #endif
-                }
-                break;
+                cpu->FLAGS |= FLAG_ZF;
             }
 
-            // ADD AX, value
-            case 0x05:
+            // Sign flag
+            if(result & 0x8000)
             {
-                uint16_t value = read16(cpu.CS * 16 + cpu.IP);
-                cpu.IP += 2;
-
-                uint32_t result = cpu.AX + value;
+                cpu->FLAGS |= FLAG_SF;
+            }
 
-                // Clear the flags we care about
-                cpu.FLAGS &= ~(FLAG_CF | FLAG_ZF | FLAG_SF | FLAG_OF);
+            // Overflow flag (signed overflow)
+            if(((cpu->AX ^ result) & (value ^ result) & 0x8000))
+            {
+                cpu->FLAGS |= FLAG_OF;
+            }
 
-                // Carry flag (unsigned overflow)
-                if(result > 0xFFFF)
-                {
-                    cpu.FLAGS |= FLAG_CF;
-                }
+            cpu->AX = result & 0xFFFF;
 
-                // Zero flag
-                if((result & 0xFFFF) == 0)
-                {
-                    cpu.FLAGS |= FLAG_ZF;
-                }
+            #if DEBUG
+            printf("Executed ADD AX, 0x%04X\n", value);
+            #endif
 
-                // Sign flag
-                if(result & 0x8000)
-                {
-                    cpu.FLAGS |= FLAG_SF;
-                }
+            break;
+        }
 
-                // Overflow flag (signed overflow)
-                if(((cpu.AX ^ result) & (value ^ result) & 0x8000))
-                {
-                    cpu.FLAGS |= FLAG_OF;
-                }
+        // SUB AX, value16
+        case 0x2D:
+        {
+            // Fetch the value
+            uint16_t value = insn.operand;
 
-                cpu.AX = result & 0xFFFF;
+            // Perform subtraction (use 32-bit to detect borrow)
+            uint32_t result = cpu->AX - value;
 
-                #ifdef DEBUG
-                printf("Executed ADD AX, 0x%04X\n", value);
-                #endif
+            // Clear any old flags we care about
+            cpu->FLAGS &= ~(FLAG_CF | FLAG_ZF | FLAG_SF | FLAG_OF);
 
-                break;
+            // Carry flag (borrow)
+            if(cpu->AX < value)
+            {
+                cpu->FLAGS |= FLAG_CF;
             }
 
-            // SUB AX, value16
-            case 0x2D:
+            // Zero flag
+            if((result & 0xFFFF) == 0)
             {
-                // Fetch the value
-                uint16_t value = read16(cpu.CS * 16 + cpu.IP);
-                cpu.IP += 2;
+                cpu->FLAGS |= FLAG_ZF;
+            }
 
-                // Perform subtraction (use 32-bit to detect borrow)
-                uint32_t result = cpu.AX - value;
+            // Sign flag (but 15)
+            if(result & 0x8000)
+            {
+                cpu->FLAGS |= FLAG_SF;
+            }
 
-                // Clear any old flags we care about
-                cpu.FLAGS &= ~(FLAG_CF | FLAG_ZF | FLAG_SF | FLAG_OF);
+            // Overflow flag (signed overflow)
+            if(((cpu->AX ^ value) & (cpu->AX ^ result) & 0x8000))
+            {
+                cpu->FLAGS |= FLAG_OF;
+            }
 
-                // Carry flag (borrow)
-                if(cpu.AX < value)
-                {
-                    cpu.FLAGS |= FLAG_CF;
-                }
+            // Store result
+            cpu->AX = result & 0xFFFF;
 
-                // Zero flag
-                if((result & 0xFFFF) == 0)
-                {
-                    cpu.FLAGS |= FLAG_ZF;
-                }
+            #if DEBUG
+            printf("Executed SUB AX, 0x%04X\n", value);
+            #endif
 
-                // Sign flag (but 15)
-                if(result & 0x8000)
-                {
-                    cpu.FLAGS |= FLAG_SF;
-                }
+            break;
+        }
 
-                // Overflow flag (signed overflow)
-                if(((cpu.AX ^ value) & (cpu.AX ^ result) & 0x8000))
-                {
-                    cpu.FLAGS |= FLAG_OF;
-                }
+        // DEC CX
+        case 0x49:
+        {
+            cpu->CX--;
 
-                // Store result
-                cpu.AX = result & 0xFFFF;
+            // Clear the flags we manage (DEC leaves CF alone)
+            cpu->FLAGS &= ~(FLAG_ZF | FLAG_SF | FLAG_OF);
 
-                #ifdef DEBUG
-                printf("Executed SUB AX, 0x%04X\n", value);
-                #endif
+            if(cpu->CX == 0)
+            {
+                cpu->FLAGS |= FLAG_ZF;
+            }
 
-                break;
+            if(cpu->CX & 0x8000)
+            {
+                cpu->FLAGS |= FLAG_SF;
             }
 
-            // DEC CX
-            case 0x49:
+            // Overflow flag - decrementing 0x8000 - 0x7FFF
+            if(cpu->CX == 0x7FFF)
             {
-                cpu.CX--;
+                cpu->FLAGS |= FLAG_OF;
+            }
 
-                // Clear the flags we manage
-                cpu.FLAGS &= ~(FLAG_ZF | FLAG_SF);
+            #if DEBUG
+            printf("Executed DEC CX\n");
+            #endif
+            break;
+        }
 
-                if(cpu.CX == 0)
-                {
-                    cpu.FLAGS |= FLAG_ZF;
-                }
+        // INC AX
+        case 0x40:
+        {
+            uint16_t old_value = cpu->AX;
+            cpu->AX++;
 
-                if(cpu.CX & 0x8000)
-                {
-                    cpu.FLAGS |= FLAG_SF;
-                }
+            // Clear the flags we care about
+            cpu->FLAGS &= ~(FLAG_ZF | FLAG_SF | FLAG_OF);
 
-                #ifdef DEBUG
-                printf("Executed DEC CX\n");
-                #endif
-                break;
+            // Zero flag
+            if(cpu->AX == 0)
+            {
+                cpu->FLAGS |= FLAG_ZF;
             }
 
-            // INC AX
-            case 0x40:
+            // Sign flag (bit 15)
+            if(cpu->AX & 0x8000)
             {
-                uint16_t old_value = cpu.AX;
-                cpu.AX++;
+                cpu->FLAGS |= FLAG_SF;
+            }
 
-                // Clear the flags we care about
-                cpu.FLAGS &= ~(FLAG_ZF | FLAG_SF | FLAG_OF);
+            // Overflow flag - incrementing 0x7FFF - 0x8000
+            if(old_value == 0x7FFF)
+            {
+                cpu->FLAGS |= FLAG_OF;
+            }
 
-                // Zero flag
-                if(cpu.AX == 0)
-                {
-                    cpu.FLAGS |= FLAG_ZF;
-                }
+            #if DEBUG
+            printf("Executed INC AX\n");
+            #endif
 
-                // Sign flag (bit 15)
-                if(cpu.AX & 0x8000)
-                {
-                    cpu.FLAGS |= FLAG_SF;
-                }
+            break;
+        }
 
-                // Overflow flag - incrementing 0x7FFF - 0x8000
-                if(old_value == 0x7FFF)
-                {
-                    cpu.FLAGS |= FLAG_OF;
-                }
+        // AND AX, value16
+        case 0x25:
+        {
+            uint16_t value = insn.operand;
 
-                #ifdef DEBUG
-                printf("Executed INC AX\n");
-                #endif
+            // Perform AND
+            cpu->AX &= value;
 
-                break;
-            }
+            // Clear the flags we care about
+            cpu->FLAGS &= ~(FLAG_CF | FLAG_OF | FLAG_ZF | FLAG_SF);
 
-            // AND AX, value16
-            case 0x25:
+            // Zero flag
+            if(cpu->AX == 0)
             {
-                uint16_t value = read16(cpu.CS * 16 + cpu.IP);
-                cpu.IP += 2;
+                cpu->FLAGS |= FLAG_ZF;
+            }
 
-                // Perform AND
-                cpu.AX &= value;
+            // Sign flag (bit 15)
+            if(cpu->AX & 0x8000)
+            {
+                cpu->FLAGS |= FLAG_SF;
+            }
 
-                // Clear the flags we care about
-                cpu.FLAGS &= ~(FLAG_CF | FLAG_OF | FLAG_ZF | FLAG_SF);
+            #if DEBUG
+            printf("Executed AND AX, 0x%04X\n", value);
+            #endif
 
-                // Zero flag
-                if(cpu.AX == 0)
-                {
-                    cpu.FLAGS |= FLAG_ZF;
-                }
+            break;
+        }
 
-                // Sign flag (bit 15)
-                if(cpu.AX & 0x8000)
-                {
-                    cpu.FLAGS |= FLAG_SF;
-                }
+        // JNE rel8
+        case 0x75:
+        {
+            int8_t offset = insn.operand;
 
-                #ifdef DEBUG
-                printf("Executed AND AX, 0x%04X\n", value);
+            if(!(cpu->FLAGS & FLAG_ZF))
+            {
+                cpu->IP += offset;
+                #if DEBUG
+                printf("Executed JNE (taken) %d\n", offset);
                 #endif
-
-                break;
             }
-
-            // JNE rel8
-            case 0x75:
+            else
             {
-                int8_t offset = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;
+                #if DEBUG
+                printf("Executed JNE (not taken)\n");
+                #endif
+            }
 
-                if(!(cpu.FLAGS & FLAG_ZF))
-                {
-                    cpu.IP += offset;
-                    #ifdef DEBUG
-                    printf("Executed JNE (taken) %d\n", offset);
-                    #endif
-                }
-                else
-                {
-                    #ifdef DEBUG
-                    printf("Executed JNE (not taken)\n");
-                    #endif
-                }
 
-                break;
-            }
+            coverage_edge(cpu);
+            break;
+        }
 
-            // JMP rel8
-            case 0xEB:
-            {
-                int8_t offset = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;           // move past the offset byte
+        // JMP rel8
+        case 0xEB:
+        {
+            int8_t offset = insn.operand;
 
-                cpu.IP += offset;
+            cpu->IP += offset;
 
-                #ifdef DEBUG
-                printf("Executed JMP %d\n", offset);
-                #endif
-                break;
-            }
+            #if DEBUG
+            printf("Executed JMP %d\n", offset);
+            #endif
 
-            // JL rel8
-            case 0x7C:
-            {
-                int8_t offset = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;
+            coverage_edge(cpu);
+            break;
+        }
 
-                int sign_flag = (cpu.FLAGS & FLAG_SF) ? 1 : 0;
-                int overflow_flag = (cpu.FLAGS & FLAG_OF) ? 1 : 0;
+        // JL rel8
+        case 0x7C:
+        {
+            int8_t offset = insn.operand;
 
-                if(sign_flag != overflow_flag)
-                {
-                    cpu.IP += offset;
-                    #ifdef DEBUG
-                    printf("Executed JL %d (taken)\n", offset);
-                    #endif
-                }
-                #ifdef DEBUG
-                else
-                {
-                    printf("Executed JL %d (not taken)\n", offset);
-                }
-                #endif
+            int sign_flag = (cpu->FLAGS & FLAG_SF) ? 1 : 0;
+            int overflow_flag = (cpu->FLAGS & FLAG_OF) ? 1 : 0;
 
-                break;
+            if(sign_flag != overflow_flag)
+            {
+                cpu->IP += offset;
+                #if DEBUG
+                printf("Executed JL %d (taken)\n", offset);
+                #endif
             }
-
-            // JG rel8
-            case 0x7F:
+            #if DEBUG
+            else
             {
-                int8_t offset = read8(cpu.CS * 16 + cpu.IP);
-                cpu.IP++;
+                printf("Executed JL %d (not taken)\n", offset);
+            }
+            #endif
 
-                int sign_flag = (cpu.FLAGS & FLAG_SF) ? 1 : 0;
-                int overflow_flag = (cpu.FLAGS & FLAG_OF) ? 1 : 0;
-                int zero_flag = (cpu.FLAGS & FLAG_ZF) ? 1 : 0;
 
-                if(!zero_flag && (sign_flag == overflow_flag))
-                {
-                    cpu.IP += offset;
+            coverage_edge(cpu);
+            break;
+        }
 
-                    #ifdef DEBUG
-                    printf("Executed JG %d (taken)\n", offset);
-                    #endif
-                }
-                #ifdef DEBUG
-                else
-                {
-                    printf("Executed JG %d (not taken)\n", offset);
-                }
-                #endif
+        // JG rel8
+        case 0x7F:
+        {
+            int8_t offset = insn.operand;
 
-                break;
-            }
+            int sign_flag = (cpu->FLAGS & FLAG_SF) ? 1 : 0;
+            int overflow_flag = (cpu->FLAGS & FLAG_OF) ? 1 : 0;
+            int zero_flag = (cpu->FLAGS & FLAG_ZF) ? 1 : 0;
 
-            default:
+            if(!zero_flag && (sign_flag == overflow_flag))
             {
+                cpu->IP += offset;
+
                 #if DEBUG
-                printf("Unknown opcode: 0x%02X\n", opcode);
+                printf("Executed JG %d (taken)\n", offset);
                 #endif
-                return 0;
             }
+            #if DEBUG
+            else
+            {
+                printf("Executed JG %d (not taken)\n", offset);
+            }
+            #endif
+
+
+            coverage_edge(cpu);
+            break;
         }
 
-        debug_state(&cpu, 1);
+        default:
+        {
+            #if DEBUG
+            printf("Unknown opcode: 0x%02X\n", opcode);
+            #endif
+            cpu->running = 0;
+            break;
+        }
     }
-
-    return 0;
 }
 
 // Function to return whatever 8-bit value is stored 
 // in memory at the address specified
 uint8_t read8(uint32_t address)
 {
-    return memory[address];
+    return memory[address & (MEMORY_SIZE - 1)];     // addresses wrap around at 1MB like on the 8086
 }
 
 // Function to write a specified 8-bit value
 // in memory at the address specified
 void write8(uint32_t address, uint8_t value)
 {
+    address &= MEMORY_SIZE - 1;
     memory[address] = value;
+
+    if(!page_dirty[address >> SNAPSHOT_PAGE_SHIFT])
+    {
+        snapshot_mark_dirty(address, 1);
+    }
+
+    // Self-modifying code - drop any translated blocks on this page
+    if(aot_code_page[address >> AOT_PAGE_SHIFT])
+    {
+        aot_invalidate(address);
+    }
 }
 
 // Function to return whatever 16-bit value is stored 
 // in memory at the address specified
 uint16_t read16(uint32_t address)
 {
-    return memory[address] | (memory[address + 1] << 8);
+    return read8(address) | (read8(address + 1) << 8);
 }
 
 // Function to write a specified 16-bit value
 // in memory at the address specified
 void write16(uint32_t address, uint16_t value)
 {
-    memory[address] = value & 0xFF;
-    memory[address + 1] = (value >> 8) & 0xFF;
+    write8(address, value & 0xFF);
+    write8(address + 1, (value >> 8) & 0xFF);
 }
 
 // Push (add) a value onto the stack
@@ -723,7 +1033,7 @@ void debug_state(CPU16 *cpu, int show_stack)
 
             for(int i = 0; i < 4; i++)
             {
-                printf(" %02X", memory[address + i]);
+                printf(" %02X", read8(address + i));
             }
 
             printf("\n");
@@ -731,4 +1041,2013 @@ void debug_state(CPU16 *cpu, int show_stack)
 
         printf("\n");
     #endif
-}
\ No newline at end of file
+}
+
+// Parse a SEG:OFF address in hex
+// Returns 0 or -1 if it isn't one
+int parse_address(const char *text, uint16_t *segment, uint16_t *offset)
+{
+    char extra;
+
+    if(sscanf(text, "%hx:%hx%c", segment, offset, &extra) != 2)
+    {
+        printf("Bad address %s (expected SEG:OFF)\n", text);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Interpret until CS:IP first reaches cs:ip
+// Returns 0 or -1 if the guest halted or took too long getting there
+int run_until(CPU16 *cpu, uint16_t cs, uint16_t ip)
+{
+    for(uint64_t count = 0; cpu->CS != cs || cpu->IP != ip; count++)
+    {
+        if(!cpu->running || count == ENTRY_BUDGET)
+        {
+            printf("Never reached %04X:%04X (stopped at %04X:%04X)\n", cs, ip, cpu->CS, cpu->IP);
+            return -1;
+        }
+
+        execute_instruction(cpu);
+    }
+
+    return 0;
+}
+
+// Print the command line options
+void usage(const char *program)
+{
+    printf("Usage: %s [options] [floppy.img] [harddisk.img]\n", program);
+    printf("  --aot-emit out.c       translate the program to C instead of running it\n");
+    printf("  --aot-load lib.so      run with a library built from --aot-emit output\n");
+    printf("  --entry SEG:OFF        interpret until CS:IP gets there before translating or fuzzing\n");
+    printf("  --fuzz seed            coverage guided fuzzing starting from a seed input\n");
+    printf("  --fuzz-runs N          stop fuzzing after N runs (default: run forever)\n");
+    printf("  --fuzz-buffer SEG:OFF  where test cases go (default: 0000:8000)\n");
+    printf("  --conformance N        test N random states per opcode\n");
+    printf("  --replay \"vector\"      rerun one vector printed by --conformance\n");
+    printf("Images the size of a standard floppy attach as drive 00, others as drive 80\n");
+}
+
+// Map a disk image and attach it to the floppy or hard disk slot
+// (anything that isn't a standard floppy size is treated as a hard disk)
+// Returns the BIOS drive number or -1 on failure
+int disk_attach(const char *path)
+{
+    // Standard floppy formats: size in KB, cylinders, heads, sectors per track and
+    // the drive type that reads them (01 = 360K, 02 = 1.2M, 03 = 720K, 04 = 1.44M, 05 = 2.88M)
+    static const struct { uint32_t kb; uint16_t cylinders; uint8_t heads; uint8_t sectors; uint8_t type; } floppies[] =
+    {
+        { 160, 40, 1, 8, 0x01 },  { 180, 40, 1, 9, 0x01 },   { 320, 40, 2, 8, 0x01 },   { 360, 40, 2, 9, 0x01 },
+        { 720, 80, 2, 9, 0x03 },  { 1200, 80, 2, 15, 0x02 }, { 1440, 80, 2, 18, 0x04 }, { 2880, 80, 2, 36, 0x05 }
+    };
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < SECTOR_SIZE)
+    {
+        printf("%s: not a valid disk image\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // Work out which slot the image goes in before mapping it
+    int format = -1;
+
+    for(size_t i = 0; i < sizeof(floppies) / sizeof(floppies[0]); i++)
+    {
+        if((uint64_t)st.st_size == (uint64_t)floppies[i].kb * 1024)
+        {
+            format = i;
+            break;
+        }
+    }
+
+    int drive = format >= 0 ? 0x00 : 0x80;
+    Disk *disk = format >= 0 ? &disks[0] : &disks[1];
+
+    if(disk->data != NULL)
+    {
+        printf("%s: drive 0x%02X already has an image\n", path, drive);
+        close(fd);
+        return -1;
+    }
+
+    // PROT_WRITE with MAP_PRIVATE gives us copy-on-write pages,
+    // the file was opened read-only so it can never be modified
+    void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(data == MAP_FAILED)
+    {
+        perror(path);
+        return -1;
+    }
+
+    // Guests mostly stream the disk from start to finish
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    if(format >= 0)
+    {
+        disk->cylinders = floppies[format].cylinders;
+        disk->heads = floppies[format].heads;
+        disk->sectors = floppies[format].sectors;
+        disk->type = floppies[format].type;
+
+        // Diskette parameter table for AH=08 to point ES:DI at
+        static const uint8_t table[] =
+        {
+            0xDF,       // step rate and head unload time
+            0x02,       // head load time, DMA mode
+            0x25,       // motor off delay (ticks)
+            0x02,       // 512 bytes per sector
+            0x00,       // sectors per track (filled in below)
+            0x1B,       // gap length
+            0xFF,       // data length
+            0x54,       // format gap length
+            0xF6,       // format fill byte
+            0x0F,       // head settle time (ms)
+            0x08        // motor start time (1/8 s)
+        };
+
+        uint32_t address = DISKETTE_TABLE_SEGMENT * 16 + DISKETTE_TABLE_OFFSET;
+        for(size_t i = 0; i < sizeof(table); i++)
+        {
+            write8(address + i, table[i]);
+        }
+        write8(address + 4, disk->sectors);
+    }
+    else
+    {
+        // Hard disk: the usual 16 heads / 63 sectors translation
+        uint32_t cylinders = st.st_size / (16 * 63 * SECTOR_SIZE);
+
+        disk->heads = 16;
+        disk->sectors = 63;
+        disk->type = 0;
+        disk->cylinders = cylinders > 1024 ? 1024 : (cylinders == 0 ? 1 : cylinders);
+    }
+
+    // One bit per sector for the snapshot undo log
+    disk->sector_saved = (uint8_t *)calloc(st.st_size / SECTOR_SIZE / 8 + 1, 1);
+    if(disk->sector_saved == NULL)
+    {
+        printf("%s: out of memory\n", path);
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    disk->data = (uint8_t *)data;
+    disk->size = st.st_size;
+    disk->next_lba = 0;
+
+    #if DEBUG
+    printf("Attached %s as drive 0x%02X (C=%d H=%d S=%d)\n", path, drive, disk->cylinders, disk->heads, disk->sectors);
+    #endif
+
+    return drive;
+}
+
+// Look up the disk for a BIOS drive number (NULL if nothing is attached)
+Disk *disk_for_drive(uint8_t drive)
+{
+    Disk *disk = NULL;
+
+    if(drive == 0x00)
+    {
+        disk = &disks[0];
+    }
+    else if(drive == 0x80)
+    {
+        disk = &disks[1];
+    }
+
+    if(disk != NULL && disk->data == NULL)
+    {
+        return NULL;
+    }
+
+    return disk;
+}
+
+// INT 13h - BIOS disk services
+// AH=00 reset, AH=02 read sectors, AH=03 write sectors, AH=08 get drive parameters
+// On return AH holds the status and CF is set if something went wrong
+void bios_disk(CPU16 *cpu)
+{
+    uint8_t function = cpu->AX >> 8;
+    uint8_t count = cpu->AX & 0xFF;                             // AL = number of sectors
+    uint16_t cylinder = (cpu->CX >> 8) | ((cpu->CX & 0xC0) << 2); // CH + top two bits of CL
+    uint8_t sector = cpu->CX & 0x3F;                            // CL bits 0-5, numbered from 1
+    uint8_t head = cpu->DX >> 8;                                // DH
+    uint8_t drive = cpu->DX & 0xFF;                             // DL
+    uint8_t status = 0x00;
+
+    Disk *disk = disk_for_drive(drive);
+
+    if(disk == NULL)
+    {
+        status = 0x80;                  // timeout (drive not ready)
+    }
+    else if(function == 0x00)
+    {
+        disk->next_lba = 0;
+    }
+    else if(function == 0x02 || function == 0x03)
+    {
+        uint32_t lba = (cylinder * disk->heads + head) * disk->sectors + (sector - 1);
+        uint32_t address = cpu->ES * 16 + cpu->BX;
+        uint32_t bytes = count * SECTOR_SIZE;
+
+        if(sector == 0 || sector > disk->sectors || head >= disk->heads || count == 0 ||
+           (uint64_t)(lba + count) * SECTOR_SIZE > disk->size)
+        {
+            status = 0x04;              // sector not found
+        }
+        else if(address + bytes > MEMORY_SIZE)
+        {
+            status = 0x09;              // DMA boundary error
+        }
+        else if(function == 0x02)
+        {
+            uint8_t *source = disk->data + (size_t)lba * SECTOR_SIZE;
+
+            // Sequential read - ask the kernel to start pulling in what comes next
+            if(lba == disk->next_lba)
+            {
+                size_t ahead = (size_t)(lba + count) * SECTOR_SIZE;
+                size_t length = READAHEAD_SECTORS * SECTOR_SIZE;
+
+                if(ahead < disk->size)
+                {
+                    if(ahead + length > disk->size)
+                    {
+                        length = disk->size - ahead;
+                    }
+
+                    // madvise wants a page aligned start
+                    size_t page = sysconf(_SC_PAGESIZE);
+                    size_t start = ahead & ~(page - 1);
+                    madvise(disk->data + start, length + (ahead - start), MADV_WILLNEED);
+                }
+            }
+
+            memcpy(&memory[address], source, bytes);
+            aot_invalidate_range(address, bytes);
+            snapshot_mark_dirty(address, bytes);
+            disk->next_lba = lba + count;
+        }
+        else
+        {
+            for(uint32_t i = 0; i < count; i++)
+            {
+                snapshot_save_sector(disk, lba + i);
+            }
+
+            memcpy(disk->data + (size_t)lba * SECTOR_SIZE, &memory[address], bytes);
+        }
+
+        #if DEBUG
+        printf("INT 13h %s %d sector(s) at LBA %d (C=%d H=%d S=%d) -> %04X:%04X\n",
+            function == 0x02 ? "read" : "write", count, lba, cylinder, head, sector, cpu->ES, cpu->BX);
+        #endif
+    }
+    else if(function == 0x08)
+    {
+        uint16_t max_cylinder = disk->cylinders - 1;
+
+        cpu->CX = ((max_cylinder & 0xFF) << 8) | ((max_cylinder >> 2) & 0xC0) | disk->sectors;
+        cpu->DX = ((disk->heads - 1) << 8) | 1;     // DL = number of drives of this type
+
+        if(drive == 0x00)
+        {
+            cpu->BX = (cpu->BX & 0xFF00) | disk->type;     // BL = drive type
+            cpu->ES = DISKETTE_TABLE_SEGMENT;                // ES:DI = diskette parameter table
+            cpu->DI = DISKETTE_TABLE_OFFSET;
+        }
+    }
+    else
+    {
+        status = 0x01;                  // invalid function
+    }
+
+    if(status == 0x00)
+    {
+        cpu->FLAGS &= ~FLAG_CF;
+    }
+    else
+    {
+        cpu->FLAGS |= FLAG_CF;
+        count = 0;
+    }
+
+    // AH = status, AL = sectors transferred (reads and writes only)
+    if(function == 0x02 || function == 0x03)
+    {
+        cpu->AX = (status << 8) | count;
+    }
+    else
+    {
+        cpu->AX = (status << 8) | (cpu->AX & 0xFF);
+    }
+}
+
+// Decode the instruction at CS:IP without executing it
+// execute_instruction and the AOT translator both use this, so operands
+// wrap around inside the code segment the same way for each
+void decode_instruction(uint16_t cs, uint16_t ip, Instruction *insn)
+{
+    uint32_t address = cs * 16 + ip;
+    uint16_t operand = read8(cs * 16 + (uint16_t)(ip + 1)) | (read8(cs * 16 + (uint16_t)(ip + 2)) << 8);
+
+    insn->opcode = read8(address);
+    insn->length = 1;
+    insn->kind = INSN_NORMAL;
+    insn->operand = 0;
+    insn->target = 0;
+
+    switch(insn->opcode)
+    {
+        // Instructions with a 16-bit immediate or memory offset
+        case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+        case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+        case 0xA1: case 0xA3:
+        case 0x3D: case 0x05: case 0x2D: case 0x25:
+            insn->operand = operand;
+            insn->length = 3;
+            break;
+
+        // Instructions with an 8-bit immediate or modrm byte
+        case 0xB4: case 0xB0:
+        case 0x8B: case 0x89:
+            insn->operand = operand & 0xFF;
+            insn->length = 2;
+            break;
+
+        case 0xCD:
+            insn->operand = operand & 0xFF;
+            insn->length = 2;
+            insn->kind = INSN_INTERRUPT;
+            break;
+
+        // Single byte instructions
+        case 0x50: case 0x58: case 0x49: case 0x40:
+            break;
+
+        // Conditional jumps and JMP rel8
+        case 0x74: case 0x75: case 0x7C: case 0x7F: case 0xEB:
+            insn->operand = operand & 0xFF;
+            insn->length = 2;
+            insn->kind = insn->opcode == 0xEB ? INSN_JUMP : INSN_BRANCH;
+            insn->target = ip + 2 + (int8_t)insn->operand;
+            break;
+
+        case 0xE8:
+            insn->operand = operand;
+            insn->length = 3;
+            insn->kind = INSN_CALL;
+            insn->target = ip + 3 + insn->operand;
+            break;
+
+        case 0xC3:
+            insn->kind = INSN_RETURN;
+            break;
+
+        case 0xF4:
+            insn->kind = INSN_HALT;
+            break;
+
+        default:
+            insn->kind = INSN_UNKNOWN;
+            break;
+    }
+}
+
+// Everything the generated C file needs to stand on its own:
+// the CPU layout, the block table type and the memory/flag helpers.
+// The flag helpers mirror the interpreter's handlers exactly
+static const char *aot_preamble =
+    "// Ahead-of-time translation generated by emulator --aot-emit\n"
+    "// Build with: cc -O2 -shared -fPIC <this file> -o <name>.so\n"
+    "#include <stdint.h>\n"
+    "\n"
+    "#define FLAG_CF 0x0001\n"
+    "#define FLAG_ZF 0x0040\n"
+    "#define FLAG_SF 0x0080\n"
+    "#define FLAG_OF 0x0800\n"
+    "\n"
+    "typedef struct\n"
+    "{\n"
+    "    int running;\n"
+    "    uint16_t AX, BX, CX, DX;\n"
+    "    uint16_t SI, DI, BP, SP;\n"
+    "    uint16_t IP;\n"
+    "    uint16_t CS, DS, ES, SS;\n"
+    "    uint16_t FLAGS;\n"
+    "} CPU16;\n"
+    "\n"
+    "typedef void (*AotFunction)(CPU16 *cpu);\n"
+    "\n"
+    "typedef struct\n"
+    "{\n"
+    "    uint16_t ip;\n"
+    "    uint16_t length;\n"
+    "    const uint8_t *bytes;\n"
+    "    AotFunction function;\n"
+    "} AotBlock;\n"
+    "\n"
+    "const uint32_t aot_cpu_size = sizeof(CPU16);\n"
+    "\n"
+    "// Reads go straight to guest memory, writes go back through the\n"
+    "// emulator so it can spot code being overwritten. When that happens\n"
+    "// code_written is set and the block hands over to the interpreter\n"
+    "static uint8_t *memory;\n"
+    "static void (*write8)(uint32_t address, uint8_t value);\n"
+    "static void (*write16)(uint32_t address, uint16_t value);\n"
+    "static uint8_t *code_written;\n"
+    "\n"
+    "void aot_bind(uint8_t *guest_memory, void (*guest_write8)(uint32_t, uint8_t), void (*guest_write16)(uint32_t, uint16_t), uint8_t *guest_code_written)\n"
+    "{\n"
+    "    memory = guest_memory;\n"
+    "    write8 = guest_write8;\n"
+    "    write16 = guest_write16;\n"
+    "    code_written = guest_code_written;\n"
+    "}\n"
+    "\n"
+    "static inline uint16_t read16(uint32_t address)\n"
+    "{\n"
+    "    return memory[address & 0xFFFFF] | (memory[(address + 1) & 0xFFFFF] << 8);\n"
+    "}\n"
+    "\n"
+    "static inline void push16(CPU16 *cpu, uint16_t value)\n"
+    "{\n"
+    "    cpu->SP -= 2;\n"
+    "    write16(cpu->SS * 16 + cpu->SP, value);\n"
+    "}\n"
+    "\n"
+    "static inline uint16_t pop16(CPU16 *cpu)\n"
+    "{\n"
+    "    uint16_t value = read16(cpu->SS * 16 + cpu->SP);\n"
+    "    cpu->SP += 2;\n"
+    "    return value;\n"
+    "}\n"
+    "\n"
+    "// CMP and SUB\n"
+    "static inline uint16_t sub16(CPU16 *cpu, uint16_t a, uint16_t b)\n"
+    "{\n"
+    "    uint16_t result = a - b;\n"
+    "    cpu->FLAGS &= ~(FLAG_CF | FLAG_ZF | FLAG_SF | FLAG_OF);\n"
+    "    if(result == 0) cpu->FLAGS |= FLAG_ZF;\n"
+    "    if(result & 0x8000) cpu->FLAGS |= FLAG_SF;\n"
+    "    if(a < b) cpu->FLAGS |= FLAG_CF;\n"
+    "    if((a ^ b) & (a ^ result) & 0x8000) cpu->FLAGS |= FLAG_OF;\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "static inline uint16_t add16(CPU16 *cpu, uint16_t a, uint16_t b)\n"
+    "{\n"
+    "    uint32_t result = a + b;\n"
+    "    cpu->FLAGS &= ~(FLAG_CF | FLAG_ZF | FLAG_SF | FLAG_OF);\n"
+    "    if(result > 0xFFFF) cpu->FLAGS |= FLAG_CF;\n"
+    "    if((result & 0xFFFF) == 0) cpu->FLAGS |= FLAG_ZF;\n"
+    "    if(result & 0x8000) cpu->FLAGS |= FLAG_SF;\n"
+    "    if((a ^ result) & (b ^ result) & 0x8000) cpu->FLAGS |= FLAG_OF;\n"
+    "    return result & 0xFFFF;\n"
+    "}\n"
+    "\n"
+    "static inline uint16_t and16(CPU16 *cpu, uint16_t a, uint16_t b)\n"
+    "{\n"
+    "    uint16_t result = a & b;\n"
+    "    cpu->FLAGS &= ~(FLAG_CF | FLAG_OF | FLAG_ZF | FLAG_SF);\n"
+    "    if(result == 0) cpu->FLAGS |= FLAG_ZF;\n"
+    "    if(result & 0x8000) cpu->FLAGS |= FLAG_SF;\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "static inline uint16_t inc16(CPU16 *cpu, uint16_t a)\n"
+    "{\n"
+    "    uint16_t result = a + 1;\n"
+    "    cpu->FLAGS &= ~(FLAG_ZF | FLAG_SF | FLAG_OF);\n"
+    "    if(result == 0) cpu->FLAGS |= FLAG_ZF;\n"
+    "    if(result & 0x8000) cpu->FLAGS |= FLAG_SF;\n"
+    "    if(a == 0x7FFF) cpu->FLAGS |= FLAG_OF;\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "static inline uint16_t dec16(CPU16 *cpu, uint16_t a)\n"
+    "{\n"
+    "    uint16_t result = a - 1;\n"
+    "    cpu->FLAGS &= ~(FLAG_ZF | FLAG_SF | FLAG_OF);\n"
+    "    if(result == 0) cpu->FLAGS |= FLAG_ZF;\n"
+    "    if(result & 0x8000) cpu->FLAGS |= FLAG_SF;\n"
+    "    if(a == 0x8000) cpu->FLAGS |= FLAG_OF;\n"
+    "    return result;\n"
+    "}\n"
+    "\n";
+
+// After a store the rest of the block may have just been overwritten,
+// so leave it to the interpreter from the next instruction on
+static void aot_emit_store_check(FILE *out, uint16_t next_ip)
+{
+    fprintf(out, "    if(*code_written) { cpu->IP = 0x%04X; return; }\n", next_ip);
+}
+
+// Write the C for one instruction of a block
+// next_ip is the address of the following instruction
+// Returns 1 if the instruction ends the block
+static int aot_emit_instruction(FILE *out, const Instruction *insn, uint16_t next_ip)
+{
+    static const char *registers[] = { "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI" };
+    uint16_t value = insn->operand;
+
+    switch(insn->opcode)
+    {
+        case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+        case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+            fprintf(out, "    cpu->%s = 0x%04X;\n", registers[insn->opcode - 0xB8], value);
+            return 0;
+
+        case 0xB4:
+            fprintf(out, "    cpu->AX = 0x%02X00 | (cpu->AX & 0x00FF);\n", value);
+            return 0;
+
+        case 0xB0:
+            fprintf(out, "    cpu->AX = (cpu->AX & 0xFF00) | 0x%02X;\n", value);
+            return 0;
+
+        case 0xA1:
+            fprintf(out, "    cpu->AX = read16(cpu->DS * 16 + 0x%04X);\n", value);
+            return 0;
+
+        case 0xA3:
+            fprintf(out, "    write16(cpu->DS * 16 + 0x%04X, cpu->AX);\n", value);
+            aot_emit_store_check(out, next_ip);
+            return 0;
+
+        // Only the [BX] form is supported, anything else does nothing (like the interpreter)
+        case 0x8B:
+            if(value == 0x07)
+            {
+                fprintf(out, "    cpu->AX = read16(cpu->DS * 16 + cpu->BX);\n");
+            }
+            return 0;
+
+        case 0x89:
+            if(value == 0x07)
+            {
+                fprintf(out, "    write16(cpu->DS * 16 + cpu->BX, cpu->AX);\n");
+                aot_emit_store_check(out, next_ip);
+            }
+            return 0;
+
+        case 0x50:
+            fprintf(out, "    push16(cpu, cpu->AX);\n");
+            aot_emit_store_check(out, next_ip);
+            return 0;
+
+        case 0x58:
+            fprintf(out, "    cpu->AX = pop16(cpu);\n");
+            return 0;
+
+        case 0x3D:
+            fprintf(out, "    sub16(cpu, cpu->AX, 0x%04X);\n", value);
+            return 0;
+
+        case 0x2D:
+            fprintf(out, "    cpu->AX = sub16(cpu, cpu->AX, 0x%04X);\n", value);
+            return 0;
+
+        case 0x05:
+            fprintf(out, "    cpu->AX = add16(cpu, cpu->AX, 0x%04X);\n", value);
+            return 0;
+
+        case 0x25:
+            fprintf(out, "    cpu->AX = and16(cpu, cpu->AX, 0x%04X);\n", value);
+            return 0;
+
+        case 0x49:
+            fprintf(out, "    cpu->CX = dec16(cpu, cpu->CX);\n");
+            return 0;
+
+        case 0x40:
+            fprintf(out, "    cpu->AX = inc16(cpu, cpu->AX);\n");
+            return 0;
+
+        case 0x74: case 0x75: case 0x7C: case 0x7F:
+        {
+            const char *condition =
+                insn->opcode == 0x74 ? "cpu->FLAGS & FLAG_ZF" :
+                insn->opcode == 0x75 ? "!(cpu->FLAGS & FLAG_ZF)" :
+                insn->opcode == 0x7C ? "!(cpu->FLAGS & FLAG_SF) != !(cpu->FLAGS & FLAG_OF)" :
+                                       "!(cpu->FLAGS & FLAG_ZF) && !(cpu->FLAGS & FLAG_SF) == !(cpu->FLAGS & FLAG_OF)";
+
+            fprintf(out, "    cpu->IP = (%s) ? 0x%04X : 0x%04X;\n", condition, insn->target, next_ip);
+            return 1;
+        }
+
+        case 0xEB:
+            fprintf(out, "    cpu->IP = 0x%04X;\n", insn->target);
+            return 1;
+
+        case 0xE8:
+            fprintf(out, "    push16(cpu, 0x%04X);\n", next_ip);
+            fprintf(out, "    cpu->IP = 0x%04X;\n", insn->target);
+            return 1;
+
+        case 0xC3:
+            fprintf(out, "    cpu->IP = pop16(cpu);\n");
+            return 1;
+
+        case 0xF4:
+            fprintf(out, "    cpu->IP = 0x%04X;\n", next_ip);
+            fprintf(out, "    cpu->running = 0;\n");
+            return 1;
+    }
+
+    return 0;
+}
+
+// Queue an address as the start of a basic block (if it isn't already)
+static void aot_add_leader(uint16_t ip, uint8_t *leader, uint16_t *worklist, int *pending)
+{
+    if(!leader[ip])
+    {
+        leader[ip] = 1;
+        worklist[(*pending)++] = ip;
+    }
+}
+
+// Translate the program at CS:IP into a C file with one function per basic block
+// Control flow is followed by recursive descent from the entry point, so code that
+// is only reached through RET or loaded at runtime is left to the interpreter
+// Returns the number of blocks written or -1 on failure
+int aot_translate(const char *path, CPU16 *cpu)
+{
+    static uint8_t visited[0x10000];    // instruction starts we have decoded
+    static uint8_t leader[0x10000];     // instruction starts that begin a block
+    static uint16_t worklist[0x10000];
+    int pending = 0;
+    uint16_t cs = cpu->CS;
+
+    // Step 1: Walk the control flow graph marking where blocks begin
+    aot_add_leader(cpu->IP, leader, worklist, &pending);
+
+    while(pending > 0)
+    {
+        uint16_t ip = worklist[--pending];
+
+        while(!visited[ip])
+        {
+            Instruction insn;
+            decode_instruction(cs, ip, &insn);
+            visited[ip] = 1;
+
+            uint16_t next_ip = ip + insn.length;
+
+            if(insn.kind == INSN_BRANCH || insn.kind == INSN_CALL)
+            {
+                aot_add_leader(insn.target, leader, worklist, &pending);
+                aot_add_leader(next_ip, leader, worklist, &pending);
+                break;
+            }
+            else if(insn.kind == INSN_JUMP)
+            {
+                aot_add_leader(insn.target, leader, worklist, &pending);
+                break;
+            }
+            else if(insn.kind == INSN_INTERRUPT)
+            {
+                // The interpreter runs the INT itself, translation picks up after it
+                aot_add_leader(next_ip, leader, worklist, &pending);
+                break;
+            }
+            else if(insn.kind != INSN_NORMAL)
+            {
+                // RET, HLT or something we can't decode
+                break;
+            }
+
+            // Running into code we've already walked - that's a join point
+            ip = next_ip;
+            if(visited[ip])
+            {
+                leader[ip] = 1;
+            }
+        }
+    }
+
+    FILE *out = fopen(path, "w");
+    if(out == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fputs(aot_preamble, out);
+
+    // Step 2: Emit a function for every block
+    static uint16_t block_ip[0x10000];
+    static uint16_t block_length[0x10000];
+    int blocks = 0;
+
+    for(uint32_t start = 0; start < 0x10000; start++)
+    {
+        Instruction insn;
+
+        if(!leader[start] || !visited[start])
+        {
+            continue;
+        }
+
+        decode_instruction(cs, start, &insn);
+        if(insn.kind == INSN_INTERRUPT || insn.kind == INSN_UNKNOWN)
+        {
+            continue;
+        }
+
+        fprintf(out, "static void block_%04X(CPU16 *cpu)\n{\n", start);
+
+        uint32_t ip = start;
+        while(1)
+        {
+            decode_instruction(cs, ip, &insn);
+
+            // Hand over to the interpreter for anything we don't translate
+            if(insn.kind == INSN_INTERRUPT || insn.kind == INSN_UNKNOWN)
+            {
+                fprintf(out, "    cpu->IP = 0x%04X;\n", ip);
+                break;
+            }
+
+            fprintf(out, "    //");
+            for(int i = 0; i < insn.length; i++)
+            {
+                fprintf(out, " %02X", read8(cs * 16 + ip + i));
+            }
+            fprintf(out, "\n");
+
+            uint32_t next_ip = ip + insn.length;
+
+            if(aot_emit_instruction(out, &insn, next_ip))
+            {
+                ip = next_ip;
+                break;
+            }
+
+            ip = next_ip;
+
+            // Falling into the next block (or off the end of the segment)
+            if(ip > 0xFFFF || leader[ip])
+            {
+                fprintf(out, "    cpu->IP = 0x%04X;\n", ip & 0xFFFF);
+                break;
+            }
+        }
+
+        fprintf(out, "}\n\n");
+
+        block_ip[blocks] = start;
+        block_length[blocks] = ip - start;
+        blocks++;
+    }
+
+    // Step 3: The original bytes of each block, so the loader can check they still match
+    for(int i = 0; i < blocks; i++)
+    {
+        fprintf(out, "static const uint8_t bytes_%04X[] = {", block_ip[i]);
+        for(int j = 0; j < block_length[i]; j++)
+        {
+            fprintf(out, "%s0x%02X", j ? ", " : " ", read8(cs * 16 + block_ip[i] + j));
+        }
+        fprintf(out, " };\n");
+    }
+
+    fprintf(out, "\nconst uint16_t aot_cs = 0x%04X;\n", cs);
+    fprintf(out, "const uint32_t aot_block_count = %d;\n", blocks);
+    fprintf(out, "const AotBlock aot_blocks[] =\n{\n");
+    for(int i = 0; i < blocks; i++)
+    {
+        fprintf(out, "    { 0x%04X, %d, bytes_%04X, block_%04X },\n", block_ip[i], block_length[i], block_ip[i], block_ip[i]);
+    }
+    fprintf(out, "};\n");
+
+    fclose(out);
+
+    #if DEBUG
+    printf("Translated %d block(s) from %04X:%04X into %s\n", blocks, cs, cpu->IP, path);
+    #endif
+
+    return blocks;
+}
+
+// Load a library built from aot_translate's output
+// Blocks whose guest code no longer matches memory are skipped and left to the interpreter
+// Returns the number of blocks in use or -1 on failure
+int aot_load(const char *path)
+{
+    void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(library == NULL)
+    {
+        printf("%s\n", dlerror());
+        return -1;
+    }
+
+    const uint32_t *cpu_size = (const uint32_t *)dlsym(library, "aot_cpu_size");
+    const uint16_t *cs = (const uint16_t *)dlsym(library, "aot_cs");
+    const uint32_t *count = (const uint32_t *)dlsym(library, "aot_block_count");
+    const AotBlock *blocks = (const AotBlock *)dlsym(library, "aot_blocks");
+    AotBind bind = (AotBind)dlsym(library, "aot_bind");
+
+    if(cpu_size == NULL || cs == NULL || count == NULL || blocks == NULL || bind == NULL || *cpu_size != sizeof(CPU16))
+    {
+        printf("%s: not an AOT library for this emulator\n", path);
+        dlclose(library);
+        return -1;
+    }
+
+    bind(memory, write8, write16, &aot_code_written);
+
+    static AotFunction entry[0x10000];
+    int used = 0;
+
+    for(uint32_t i = 0; i < *count; i++)
+    {
+        uint32_t address = *cs * 16 + blocks[i].ip;
+
+        if(address + blocks[i].length > MEMORY_SIZE || memcmp(&memory[address], blocks[i].bytes, blocks[i].length) != 0)
+        {
+            continue;
+        }
+
+        entry[blocks[i].ip] = blocks[i].function;
+
+        for(uint32_t page = address >> AOT_PAGE_SHIFT; page <= (address + blocks[i].length - 1) >> AOT_PAGE_SHIFT; page++)
+        {
+            aot_code_page[page] = 1;
+        }
+
+        used++;
+    }
+
+    aot_entry = entry;
+    aot_cs = *cs;
+    aot_blocks = blocks;
+    aot_block_count = *count;
+
+    #if DEBUG
+    printf("Loaded %d of %d translated block(s) from %s\n", used, *count, path);
+    #endif
+
+    return used;
+}
+
+// Guest code on this address's page has been written to,
+// so stop using every translated block that touches the page
+void aot_invalidate(uint32_t address)
+{
+    uint32_t page = address >> AOT_PAGE_SHIFT;
+
+    for(uint32_t i = 0; i < aot_block_count; i++)
+    {
+        uint32_t start = aot_cs * 16 + aot_blocks[i].ip;
+        uint32_t end = start + aot_blocks[i].length - 1;
+
+        if((start >> AOT_PAGE_SHIFT) <= page && page <= (end >> AOT_PAGE_SHIFT))
+        {
+            aot_entry[aot_blocks[i].ip] = NULL;
+        }
+    }
+
+    aot_code_page[page] = 0;
+    aot_code_written = 1;
+}
+
+// Same as aot_invalidate for every page in a range of memory
+void aot_invalidate_range(uint32_t address, uint32_t length)
+{
+    for(uint32_t page = address >> AOT_PAGE_SHIFT; page <= (address + length - 1) >> AOT_PAGE_SHIFT; page++)
+    {
+        if(aot_code_page[page])
+        {
+            aot_invalidate(page << AOT_PAGE_SHIFT);
+        }
+    }
+}
+
+// Record that some memory has changed since the last snapshot
+void snapshot_mark_dirty(uint32_t address, uint32_t length)
+{
+    for(uint32_t page = address >> SNAPSHOT_PAGE_SHIFT; page <= (address + length - 1) >> SNAPSHOT_PAGE_SHIFT; page++)
+    {
+        if(!page_dirty[page])
+        {
+            page_dirty[page] = 1;
+            dirty_pages[dirty_count++] = page;
+        }
+    }
+}
+
+// Save the whole machine so snapshot_restore can come back to it
+void snapshot_take(CPU16 *cpu)
+{
+    memcpy(snapshot_memory, memory, MEMORY_SIZE);
+    snapshot_cpu = *cpu;
+
+    for(uint32_t i = 0; i < dirty_count; i++)
+    {
+        page_dirty[dirty_pages[i]] = 0;
+    }
+    dirty_count = 0;
+
+    // The disks as they are now are part of the snapshot
+    for(uint32_t i = 0; i < saved_count; i++)
+    {
+        saved_sectors[i].disk->sector_saved[saved_sectors[i].lba / 8] &= ~(1 << (saved_sectors[i].lba % 8));
+    }
+    saved_count = 0;
+
+    snapshot_next_lba[0] = disks[0].next_lba;
+    snapshot_next_lba[1] = disks[1].next_lba;
+    snapshot_taken = 1;
+}
+
+// Keep a copy of a disk sector before INT 13h overwrites it (once per snapshot)
+void snapshot_save_sector(Disk *disk, uint32_t lba)
+{
+    if(!snapshot_taken || (disk->sector_saved[lba / 8] & (1 << (lba % 8))))
+    {
+        return;
+    }
+
+    if(saved_count == saved_capacity)
+    {
+        uint32_t capacity = saved_capacity ? saved_capacity * 2 : 64;
+        SavedSector *sectors = (SavedSector *)realloc(saved_sectors, capacity * sizeof(SavedSector));
+        if(sectors == NULL)
+        {
+            // Without the old contents the snapshot can't be restored
+            printf("Out of memory saving disk sector %u\n", lba);
+            exit(1);
+        }
+        saved_sectors = sectors;
+        saved_capacity = capacity;
+    }
+
+    SavedSector *saved = &saved_sectors[saved_count++];
+    saved->disk = disk;
+    saved->lba = lba;
+    memcpy(saved->data, disk->data + (size_t)lba * SECTOR_SIZE, SECTOR_SIZE);
+    disk->sector_saved[lba / 8] |= 1 << (lba % 8);
+}
+
+// Put the machine back how it was at snapshot_take
+// Only pages and disk sectors written since then are copied back
+void snapshot_restore(CPU16 *cpu)
+{
+    for(uint32_t i = 0; i < dirty_count; i++)
+    {
+        uint32_t page = dirty_pages[i];
+        uint32_t offset = page << SNAPSHOT_PAGE_SHIFT;
+
+        memcpy(&memory[offset], &snapshot_memory[offset], 1 << SNAPSHOT_PAGE_SHIFT);
+        page_dirty[page] = 0;
+    }
+    dirty_count = 0;
+
+    // Same for any disk sectors written since
+    for(uint32_t i = 0; i < saved_count; i++)
+    {
+        SavedSector *saved = &saved_sectors[i];
+
+        memcpy(saved->disk->data + (size_t)saved->lba * SECTOR_SIZE, saved->data, SECTOR_SIZE);
+        saved->disk->sector_saved[saved->lba / 8] &= ~(1 << (saved->lba % 8));
+    }
+    saved_count = 0;
+
+    disks[0].next_lba = snapshot_next_lba[0];
+    disks[1].next_lba = snapshot_next_lba[1];
+
+    *cpu = snapshot_cpu;
+    coverage_previous = 0;
+}
+
+// Small fast random numbers for the mutator (xorshift64)
+static uint64_t fuzz_random_state = 0x2545F4914F6CDD1Dull;
+
+static inline uint32_t fuzz_random(uint32_t limit)
+{
+    fuzz_random_state ^= fuzz_random_state << 13;
+    fuzz_random_state ^= fuzz_random_state >> 7;
+    fuzz_random_state ^= fuzz_random_state << 17;
+    return (uint32_t)(fuzz_random_state >> 32) % limit;
+}
+
+// Randomly change a test case in place (AFL style havoc)
+// Returns the new length
+static uint32_t fuzz_mutate(uint8_t *data, uint32_t length)
+{
+    static const uint16_t interesting[] = { 0x0000, 0x0001, 0x007F, 0x0080, 0x00FF, 0x0100, 0x7FFF, 0x8000, 0xFFFF };
+    int changes = 1 << (1 + fuzz_random(5));
+
+    for(int i = 0; i < changes; i++)
+    {
+        uint32_t position = fuzz_random(length);
+
+        switch(fuzz_random(6))
+        {
+            // Flip a bit
+            case 0:
+                data[position] ^= 1 << fuzz_random(8);
+                break;
+
+            // Random byte
+            case 1:
+                data[position] = fuzz_random(256);
+                break;
+
+            // Add or subtract a little
+            case 2:
+                data[position] += fuzz_random(35) - 17;
+                break;
+
+            // Interesting 16-bit value
+            case 3:
+                if(position + 1 < length)
+                {
+                    uint16_t value = interesting[fuzz_random(sizeof(interesting) / sizeof(interesting[0]))];
+                    data[position] = value & 0xFF;
+                    data[position + 1] = value >> 8;
+                }
+                break;
+
+            // Grow by repeating a byte
+            case 4:
+                if(length < FUZZ_MAX_INPUT)
+                {
+                    memmove(&data[position + 1], &data[position], length - position);
+                    length++;
+                }
+                break;
+
+            // Shrink
+            case 5:
+                if(length > 1)
+                {
+                    memmove(&data[position], &data[position + 1], length - position - 1);
+                    length--;
+                }
+                break;
+        }
+    }
+
+    return length;
+}
+
+// Merge the coverage from the last run into a "seen" map
+// Returns 1 if the run reached an edge we hadn't seen before
+static int fuzz_new_coverage(uint8_t *seen)
+{
+    int found = 0;
+
+    for(uint32_t i = 0; i < COVERAGE_MAP_SIZE / 8; i++)
+    {
+        // Most of the map is empty, skip it eight bytes at a time
+        // (memcpy keeps the load legal for a byte array and compiles to one move)
+        uint64_t word;
+        memcpy(&word, &coverage_map[i * 8], sizeof(word));
+        if(word == 0)
+        {
+            continue;
+        }
+
+        // Only care whether an edge was hit, not how often
+        for(uint32_t j = i * 8; j < i * 8 + 8; j++)
+        {
+            if(coverage_map[j] && !seen[j])
+            {
+                seen[j] = 1;
+                found = 1;
+            }
+        }
+    }
+
+    return found;
+}
+
+// Coverage guided fuzzing
+// The machine as it is now (at --entry, so after the guest has set itself up)
+// becomes the snapshot. Every run restores it, puts a test case in the guest
+// buffer at buffer_segment:buffer_offset (BX = offset, CX = length) and
+// interprets up to FUZZ_BUDGET instructions. Disk writes are undone with the rest.
+// Inputs reaching new edges join the queue. Runs that stop on an unknown
+// opcode are crashes and the ones with new edges are saved to crash-N.bin
+// Runs forever when runs is 0
+int fuzz(CPU16 *cpu, const char *seed_path, uint64_t runs, uint16_t buffer_segment, uint16_t buffer_offset)
+{
+    static uint8_t queue[FUZZ_QUEUE_SIZE][FUZZ_MAX_INPUT];
+    static uint32_t queue_length[FUZZ_QUEUE_SIZE];
+    static uint8_t seen[COVERAGE_MAP_SIZE];
+    static uint8_t seen_crash[COVERAGE_MAP_SIZE];
+    static uint8_t input[FUZZ_MAX_INPUT];
+    uint32_t queued = 0;
+    uint64_t crashes = 0;
+    uint64_t hangs = 0;
+    uint32_t buffer = buffer_segment * 16 + buffer_offset;
+
+    // The biggest test case has to fit without wrapping the offset or memory
+    if(buffer_offset > 0x10000 - FUZZ_MAX_INPUT || buffer > MEMORY_SIZE - FUZZ_MAX_INPUT)
+    {
+        printf("No room for a %u byte test case at %04X:%04X\n", FUZZ_MAX_INPUT, buffer_segment, buffer_offset);
+        return -1;
+    }
+
+    FILE *seed = fopen(seed_path, "rb");
+    if(seed == NULL)
+    {
+        perror(seed_path);
+        return -1;
+    }
+
+    queue_length[0] = fread(queue[0], 1, FUZZ_MAX_INPUT, seed);
+    fclose(seed);
+
+    if(queue_length[0] == 0)
+    {
+        queue[0][0] = 0;
+        queue_length[0] = 1;
+    }
+    queued = 1;
+
+    #if DEBUG
+    printf("Warning: fuzzing with DEBUG output on, build with -DDEBUG=0\n");
+    #endif
+
+    fuzz_random_state ^= (uint64_t)time(NULL) << 16;
+    snapshot_take(cpu);
+
+    time_t started = time(NULL);
+    time_t last_report = started;
+    uint64_t run = 0;
+
+    while(runs == 0 || run < runs)
+    {
+        // Pick something from the queue and mutate it (the seed goes in as it is first)
+        uint32_t pick = run == 0 ? 0 : fuzz_random(queued);
+        uint32_t length = queue_length[pick];
+
+        memcpy(input, queue[pick], length);
+        if(run > 0)
+        {
+            length = fuzz_mutate(input, length);
+        }
+
+        // Inject the test case
+        memcpy(&memory[buffer], input, length);
+        snapshot_mark_dirty(buffer, length);
+        cpu->BX = buffer_offset;
+        cpu->CX = length;
+
+        // Run under the instruction budget
+        memset(coverage_map, 0, sizeof(coverage_map));
+
+        uint32_t executed = 0;
+        while(cpu->running && executed < FUZZ_BUDGET)
+        {
+            execute_instruction(cpu);
+            executed++;
+        }
+
+        // Both HLT and unknown opcodes stop the CPU one byte past the opcode
+        if(cpu->running)
+        {
+            hangs++;
+        }
+        else if(read8(cpu->CS * 16 + (uint16_t)(cpu->IP - 1)) != 0xF4)
+        {
+            crashes++;
+
+            if(fuzz_new_coverage(seen_crash))
+            {
+                char name[32];
+                snprintf(name, sizeof(name), "crash-%llu.bin", (unsigned long long)crashes);
+
+                FILE *out = fopen(name, "wb");
+                if(out != NULL)
+                {
+                    fwrite(input, 1, length, out);
+                    fclose(out);
+                }
+            }
+        }
+
+        if(fuzz_new_coverage(seen) && queued < FUZZ_QUEUE_SIZE)
+        {
+            memcpy(queue[queued], input, length);
+            queue_length[queued] = length;
+            queued++;
+        }
+
+        snapshot_restore(cpu);
+        run++;
+
+        // Stats about once a second (checking the clock every run would cost too much)
+        if((run & 0x3FF) == 0 || run == runs)
+        {
+            time_t now = time(NULL);
+
+            if(now != last_report || run == runs)
+            {
+                uint32_t edges = 0;
+                for(uint32_t i = 0; i < COVERAGE_MAP_SIZE; i++)
+                {
+                    edges += seen[i];
+                }
+
+                printf("runs %llu  execs/s %llu  edges %u  queue %u  crashes %llu  hangs %llu\n",
+                    (unsigned long long)run,
+                    (unsigned long long)(run / (now > started ? now - started : 1)),
+                    edges, queued, (unsigned long long)crashes, (unsigned long long)hangs);
+                fflush(stdout);
+                last_report = now;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Differential conformance testing
+// Random machine states are run through the interpreter and through a
+// separately written reference model of the same instructions, and every
+// register, flag and memory byte is compared. The decoder used by the AOT
+// translator is checked against the reference at the same time.
+
+// Everything needed to reproduce one test
+typedef struct
+{
+    CPU16 cpu;              // registers before the instruction
+    uint8_t code[3];        // opcode and up to two operand bytes at CS:IP
+    uint16_t data_bx;       // word at DS:BX
+    uint16_t data_offset;   // word at DS:[operand]
+    uint16_t stack;         // word at SS:SP
+} TestVector;
+
+// Memory the reference model wants to write
+typedef struct
+{
+    uint32_t address;
+    uint8_t value;
+} ReferenceWrite;
+
+// Opcodes under test (INT is left out, it does I/O)
+static const uint8_t conformance_opcodes[] =
+{
+    0xB8, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF, 0xB4, 0xB0,
+    0xA1, 0xA3, 0x8B, 0x89, 0x50, 0x58, 0xE8, 0xC3, 0xF4,
+    0x3D, 0x05, 0x2D, 0x25, 0x49, 0x40, 0x74, 0x75, 0x7C, 0x7F, 0xEB
+};
+
+#define REPLAY_FORMAT "%hhX %hhX %hhX AX=%hX BX=%hX CX=%hX DX=%hX SI=%hX DI=%hX BP=%hX SP=%hX " \
+                      "IP=%hX CS=%hX DS=%hX ES=%hX SS=%hX FLAGS=%hX [BX]=%hX [imm]=%hX [SP]=%hX"
+#define PRINT_FORMAT "%02X %02X %02X AX=%04X BX=%04X CX=%04X DX=%04X SI=%04X DI=%04X BP=%04X SP=%04X " \
+                     "IP=%04X CS=%04X DS=%04X ES=%04X SS=%04X FLAGS=%04X [BX]=%04X [imm]=%04X [SP]=%04X"
+
+static uint8_t reference_read8(uint32_t address)
+{
+    return memory[address & 0xFFFFF];
+}
+
+static uint16_t reference_read16(uint32_t address)
+{
+    return reference_read8(address) | (reference_read8(address + 1) << 8);
+}
+
+static void reference_write16(ReferenceWrite *writes, int *count, uint32_t address, uint16_t value)
+{
+    writes[(*count)++] = (ReferenceWrite){ address & 0xFFFFF, (uint8_t)value };
+    writes[(*count)++] = (ReferenceWrite){ (address + 1) & 0xFFFFF, (uint8_t)(value >> 8) };
+}
+
+// CF/ZF/SF/OF for a 16-bit add or subtract as the 8086 manual defines them
+// use_carry is 0 for INC and DEC, which leave CF alone
+static uint16_t reference_arith16(CPU16 *cpu, uint16_t a, uint16_t b, int subtract, int use_carry)
+{
+    uint32_t wide = subtract ? (uint32_t)a - b : (uint32_t)a + b;
+    uint16_t result = wide;
+    int a_sign = a >> 15, b_sign = (subtract ? ~b : b) >> 15 & 1, r_sign = result >> 15;
+    uint16_t flags = cpu->FLAGS & ~(FLAG_ZF | FLAG_SF | FLAG_OF | (use_carry ? FLAG_CF : 0));
+
+    if(use_carry && (wide >> 16) != 0)  flags |= FLAG_CF;
+    if(result == 0)                     flags |= FLAG_ZF;
+    if(r_sign)                          flags |= FLAG_SF;
+    if(a_sign == b_sign && r_sign != a_sign) flags |= FLAG_OF;
+
+    cpu->FLAGS = flags;
+    return result;
+}
+
+// The reference model: what one instruction should do to the machine
+// Reads come from memory, writes are returned instead of made
+// Also returns the instruction length and the jump/call target (if any)
+static void reference_execute(CPU16 *cpu, ReferenceWrite *writes, int *count, int *length, uint16_t *target)
+{
+    uint32_t at = cpu->CS * 16;
+    uint16_t ip = cpu->IP;
+    uint8_t opcode = reference_read8(at + ip);
+    uint8_t imm8 = reference_read8(at + (uint16_t)(ip + 1));
+    uint16_t imm16 = imm8 | (reference_read8(at + (uint16_t)(ip + 2)) << 8);
+    uint16_t *registers[] = { &cpu->AX, &cpu->CX, &cpu->DX, &cpu->BX, &cpu->SP, &cpu->BP, &cpu->SI, &cpu->DI };
+    int sf = !!(cpu->FLAGS & FLAG_SF), of = !!(cpu->FLAGS & FLAG_OF), zf = !!(cpu->FLAGS & FLAG_ZF);
+    int taken = 0;
+
+    *count = 0;
+    *target = 0;
+
+    // Length first
+    if(opcode >= 0xB8 && opcode <= 0xBF)                                    *length = 3;
+    else if(opcode == 0xA1 || opcode == 0xA3 || opcode == 0xE8)             *length = 3;
+    else if(opcode == 0x3D || opcode == 0x05 || opcode == 0x2D || opcode == 0x25) *length = 3;
+    else if(opcode == 0xB4 || opcode == 0xB0 || opcode == 0x8B || opcode == 0x89) *length = 2;
+    else if(opcode == 0x74 || opcode == 0x75 || opcode == 0x7C || opcode == 0x7F || opcode == 0xEB) *length = 2;
+    else                                                                    *length = 1;
+
+    uint16_t next = ip + *length;
+    cpu->IP = next;
+
+    switch(opcode)
+    {
+        case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+        case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+            *registers[opcode & 7] = imm16;
+            break;
+
+        case 0xB4: cpu->AX = (cpu->AX & 0x00FF) | (imm8 << 8); break;
+        case 0xB0: cpu->AX = (cpu->AX & 0xFF00) | imm8; break;
+
+        case 0xA1: cpu->AX = reference_read16(cpu->DS * 16 + imm16); break;
+        case 0xA3: reference_write16(writes, count, cpu->DS * 16 + imm16, cpu->AX); break;
+
+        // Only the [BX] form is implemented, the others do nothing
+        case 0x8B: if(imm8 == 0x07) cpu->AX = reference_read16(cpu->DS * 16 + cpu->BX); break;
+        case 0x89: if(imm8 == 0x07) reference_write16(writes, count, cpu->DS * 16 + cpu->BX, cpu->AX); break;
+
+        case 0x50:
+            cpu->SP -= 2;
+            reference_write16(writes, count, cpu->SS * 16 + cpu->SP, cpu->AX);
+            break;
+
+        case 0x58:
+            cpu->AX = reference_read16(cpu->SS * 16 + cpu->SP);
+            cpu->SP += 2;
+            break;
+
+        case 0xE8:
+            *target = next + imm16;
+            cpu->SP -= 2;
+            reference_write16(writes, count, cpu->SS * 16 + cpu->SP, next);
+            cpu->IP = *target;
+            break;
+
+        case 0xC3:
+            cpu->IP = reference_read16(cpu->SS * 16 + cpu->SP);
+            cpu->SP += 2;
+            break;
+
+        case 0xF4: cpu->running = 0; break;
+
+        case 0x3D: reference_arith16(cpu, cpu->AX, imm16, 1, 1); break;
+        case 0x2D: cpu->AX = reference_arith16(cpu, cpu->AX, imm16, 1, 1); break;
+        case 0x05: cpu->AX = reference_arith16(cpu, cpu->AX, imm16, 0, 1); break;
+        case 0x49: cpu->CX = reference_arith16(cpu, cpu->CX, 1, 1, 0); break;
+        case 0x40: cpu->AX = reference_arith16(cpu, cpu->AX, 1, 0, 0); break;
+
+        case 0x25:
+            cpu->AX &= imm16;
+            cpu->FLAGS &= ~(FLAG_CF | FLAG_OF | FLAG_ZF | FLAG_SF);
+            if(cpu->AX == 0)      cpu->FLAGS |= FLAG_ZF;
+            if(cpu->AX & 0x8000)  cpu->FLAGS |= FLAG_SF;
+            break;
+
+        case 0x74: taken = zf; break;
+        case 0x75: taken = !zf; break;
+        case 0x7C: taken = sf != of; break;
+        case 0x7F: taken = !zf && sf == of; break;
+        case 0xEB: taken = 1; break;
+
+        default: cpu->running = 0; break;
+    }
+
+    if(opcode == 0x74 || opcode == 0x75 || opcode == 0x7C || opcode == 0x7F || opcode == 0xEB)
+    {
+        *target = next + (int8_t)imm8;
+        if(taken)
+        {
+            cpu->IP = *target;
+        }
+    }
+}
+
+// Append to a report buffer (if there is one)
+static void conformance_note(char *report, size_t size, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static void conformance_note(char *report, size_t size, const char *format, ...)
+{
+    if(report == NULL)
+    {
+        return;
+    }
+
+    size_t used = strlen(report);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(report + used, size - used, format, args);
+    va_end(args);
+}
+
+// The contents of a page as the vector set it up, before anything ran
+static const uint8_t *conformance_page_before(uint32_t page, uint8_t before[][1 << SNAPSHOT_PAGE_SHIFT], const uint32_t *before_page, uint32_t before_count)
+{
+    for(uint32_t i = 0; i < before_count; i++)
+    {
+        if(before_page[i] == page)
+        {
+            return before[i];
+        }
+    }
+
+    return &snapshot_memory[page << SNAPSHOT_PAGE_SHIFT];
+}
+
+// Run one vector through the reference model, the interpreter and (if aot isn't NULL)
+// the translated version of the same instruction, and compare them
+// Returns the number of differences, described in report if it isn't NULL
+static int conformance_run(const TestVector *vector, AotFunction aot, char *report, size_t size)
+{
+    static uint8_t before[16][1 << SNAPSHOT_PAGE_SHIFT];
+    static uint32_t before_page[16];
+    static uint8_t after[32][1 << SNAPSHOT_PAGE_SHIFT];
+    static uint8_t expected[1 << SNAPSHOT_PAGE_SHIFT];
+    static uint32_t check_page[32];
+    ReferenceWrite writes[4];
+    int write_count, length;
+    uint16_t target;
+    int differences = 0;
+    CPU16 reference = vector->cpu;
+    CPU16 actual = vector->cpu;
+    const CPU16 *v = &vector->cpu;
+
+    // Step 1: Build the starting state (code last so it wins any overlap)
+    snapshot_restore(&actual);
+    actual = vector->cpu;
+
+    write16(v->DS * 16 + v->BX, vector->data_bx);
+    write16(v->DS * 16 + (vector->code[1] | (vector->code[2] << 8)), vector->data_offset);
+    write16(v->SS * 16 + v->SP, vector->stack);
+    for(int i = 0; i < 3; i++)
+    {
+        write8(v->CS * 16 + (uint16_t)(v->IP + i), vector->code[i]);
+    }
+
+    uint32_t before_count = dirty_count;
+    for(uint32_t i = 0; i < before_count; i++)
+    {
+        before_page[i] = dirty_pages[i];
+        memcpy(before[i], &memory[dirty_pages[i] << SNAPSHOT_PAGE_SHIFT], sizeof(before[i]));
+    }
+
+    // Step 2: Decoder, reference model, then the interpreter
+    // (the decoder goes first, the instruction might overwrite itself)
+    Instruction insn;
+    decode_instruction(v->CS, v->IP, &insn);
+    reference_execute(&reference, writes, &write_count, &length, &target);
+    execute_instruction(&actual);
+
+    // Step 3: Registers and flags
+    #define CHECK(label, want, got, field) \
+        if(want.field != got.field) \
+        { \
+            conformance_note(report, size, "  %s%-7s expected %04X got %04X\n", label, #field, (unsigned)want.field, (unsigned)got.field); \
+            differences++; \
+        }
+
+    #define CHECK_CPU(label, want, got) \
+        CHECK(label, want, got, running) CHECK(label, want, got, AX) CHECK(label, want, got, BX) \
+        CHECK(label, want, got, CX) CHECK(label, want, got, DX) CHECK(label, want, got, SI) \
+        CHECK(label, want, got, DI) CHECK(label, want, got, BP) CHECK(label, want, got, SP) \
+        CHECK(label, want, got, IP) CHECK(label, want, got, CS) CHECK(label, want, got, DS) \
+        CHECK(label, want, got, ES) CHECK(label, want, got, SS) CHECK(label, want, got, FLAGS)
+
+    CHECK_CPU("", reference, actual)
+
+    // Step 4: Memory - every page either side touched
+    uint32_t checks = 0;
+    for(uint32_t i = 0; i < dirty_count; i++)
+    {
+        check_page[checks++] = dirty_pages[i];
+    }
+    for(int i = 0; i < write_count; i++)
+    {
+        uint32_t page = writes[i].address >> SNAPSHOT_PAGE_SHIFT;
+        if(!page_dirty[page])
+        {
+            check_page[checks++] = page;
+            snapshot_mark_dirty(page << SNAPSHOT_PAGE_SHIFT, 1);     // so the next restore tidies it
+        }
+    }
+
+    for(uint32_t i = 0; i < checks; i++)
+    {
+        uint32_t page = check_page[i];
+        uint32_t base = page << SNAPSHOT_PAGE_SHIFT;
+
+        memcpy(expected, conformance_page_before(page, before, before_page, before_count), sizeof(expected));
+        for(int j = 0; j < write_count; j++)
+        {
+            if((writes[j].address >> SNAPSHOT_PAGE_SHIFT) == page)
+            {
+                expected[writes[j].address - base] = writes[j].value;
+            }
+        }
+
+        if(memcmp(expected, &memory[base], sizeof(expected)) != 0)
+        {
+            for(uint32_t j = 0; j < sizeof(expected); j++)
+            {
+                if(expected[j] != memory[base + j])
+                {
+                    conformance_note(report, size, "  [%05X] expected %02X got %02X\n", base + j, expected[j], memory[base + j]);
+                    differences++;
+                }
+            }
+        }
+    }
+
+    // Step 5: The decoder has to agree on length and target
+    if(insn.length != length)
+    {
+        conformance_note(report, size, "  decoder length %d, expected %d\n", insn.length, length);
+        differences++;
+    }
+
+    if((insn.kind == INSN_BRANCH || insn.kind == INSN_JUMP || insn.kind == INSN_CALL) && insn.target != target)
+    {
+        conformance_note(report, size, "  decoder target %04X, expected %04X\n", insn.target, target);
+        differences++;
+    }
+
+    // Step 6: The translated instruction has to do exactly what the interpreter did
+    if(aot != NULL)
+    {
+        // Keep what the interpreter left behind, then rewind memory to the starting state
+        uint32_t after_count = dirty_count;
+        for(uint32_t i = 0; i < after_count; i++)
+        {
+            uint32_t base = dirty_pages[i] << SNAPSHOT_PAGE_SHIFT;
+
+            memcpy(after[i], &memory[base], sizeof(after[i]));
+            memcpy(&memory[base], conformance_page_before(dirty_pages[i], before, before_page, before_count), sizeof(after[i]));
+        }
+
+        CPU16 translated = vector->cpu;
+        aot(&translated);
+
+        CHECK_CPU("AOT ", actual, translated)
+
+        for(uint32_t i = 0; i < dirty_count; i++)
+        {
+            uint32_t base = dirty_pages[i] << SNAPSHOT_PAGE_SHIFT;
+            const uint8_t *interpreted = i < after_count ? after[i] :
+                conformance_page_before(dirty_pages[i], before, before_page, before_count);
+
+            if(memcmp(interpreted, &memory[base], sizeof(after[i])) != 0)
+            {
+                for(uint32_t j = 0; j < sizeof(after[i]); j++)
+                {
+                    if(interpreted[j] != memory[base + j])
+                    {
+                        conformance_note(report, size, "  AOT [%05X] expected %02X got %02X\n", base + j, interpreted[j], memory[base + j]);
+                        differences++;
+                    }
+                }
+            }
+        }
+    }
+
+    #undef CHECK_CPU
+    #undef CHECK
+
+    return differences;
+}
+
+// Translate one instruction per template with the AOT emitter, compile the
+// result with $CC (cc by default) and load it
+// Returns the library's block table in template order, or NULL without a compiler
+static const AotBlock *conformance_build_aot(const TestVector *templates, int count)
+{
+    char directory[] = "/tmp/conformance-XXXXXX";
+    char source[64];
+    char library[64];
+    char command[256];
+
+    if(mkdtemp(directory) == NULL)
+    {
+        return NULL;
+    }
+
+    snprintf(source, sizeof(source), "%s/vectors.c", directory);
+    snprintf(library, sizeof(library), "%s/vectors.so", directory);
+
+    FILE *out = fopen(source, "w");
+    if(out == NULL)
+    {
+        rmdir(directory);
+        return NULL;
+    }
+
+    fputs(aot_preamble, out);
+
+    for(int i = 0; i < count; i++)
+    {
+        const CPU16 *c = &templates[i].cpu;
+        Instruction insn;
+
+        for(int j = 0; j < 3; j++)
+        {
+            write8(c->CS * 16 + (uint16_t)(c->IP + j), templates[i].code[j]);
+        }
+        decode_instruction(c->CS, c->IP, &insn);
+
+        uint16_t next_ip = c->IP + insn.length;
+
+        fprintf(out, "static void test_%d(CPU16 *cpu)\n{\n", i);
+        if(!aot_emit_instruction(out, &insn, next_ip))
+        {
+            fprintf(out, "    cpu->IP = 0x%04X;\n", next_ip);
+        }
+        fprintf(out, "}\n\n");
+    }
+
+    fprintf(out, "const uint16_t aot_cs = 0x0000;\n");
+    fprintf(out, "const uint32_t aot_block_count = %d;\n", count);
+    fprintf(out, "const AotBlock aot_blocks[] =\n{\n");
+    for(int i = 0; i < count; i++)
+    {
+        fprintf(out, "    { 0x%04X, 0, 0, test_%d },\n", templates[i].cpu.IP, i);
+    }
+    fprintf(out, "};\n");
+    fclose(out);
+
+    const char *cc = getenv("CC") != NULL ? getenv("CC") : "cc";
+    snprintf(command, sizeof(command), "%s -O2 -shared -fPIC -o %s %s 2>/dev/null", cc, library, source);
+
+    void *handle = system(command) == 0 ? dlopen(library, RTLD_NOW | RTLD_LOCAL) : NULL;
+
+    // Once it's loaded the files aren't needed
+    unlink(source);
+    unlink(library);
+    rmdir(directory);
+
+    if(handle == NULL)
+    {
+        return NULL;
+    }
+
+    AotBind bind = (AotBind)dlsym(handle, "aot_bind");
+    const AotBlock *blocks = (const AotBlock *)dlsym(handle, "aot_blocks");
+
+    if(bind == NULL || blocks == NULL)
+    {
+        dlclose(handle);
+        return NULL;
+    }
+
+    bind(memory, write8, write16, &aot_code_written);
+    return blocks;
+}
+
+// A random starting state for an opcode
+static void conformance_random(TestVector *vector, uint8_t opcode)
+{
+    uint16_t *fields[] = { &vector->cpu.AX, &vector->cpu.BX, &vector->cpu.CX, &vector->cpu.DX,
+                           &vector->cpu.SI, &vector->cpu.DI, &vector->cpu.BP, &vector->cpu.SP,
+                           &vector->cpu.IP, &vector->cpu.CS, &vector->cpu.DS, &vector->cpu.ES,
+                           &vector->cpu.SS, &vector->cpu.FLAGS, &vector->data_bx, &vector->data_offset,
+                           &vector->stack };
+
+    for(size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        // Mostly random, sometimes the values that sit on flag boundaries
+        static const uint16_t edges[] = { 0x0000, 0x0001, 0x7FFF, 0x8000, 0xFFFF };
+        *fields[i] = fuzz_random(8) == 0 ? edges[fuzz_random(5)] : fuzz_random(0x10000);
+    }
+
+    vector->cpu.running = 1;
+    vector->code[0] = opcode;
+    vector->code[1] = fuzz_random(256);
+    vector->code[2] = fuzz_random(256);
+
+    // The operand of an immediate instruction likes edge values too
+    if(fuzz_random(4) == 0)
+    {
+        static const uint16_t edges[] = { 0x0000, 0x0001, 0x7FFF, 0x8000, 0xFFFF };
+        uint16_t value = edges[fuzz_random(5)];
+        vector->code[1] = value & 0xFF;
+        vector->code[2] = value >> 8;
+    }
+
+    // Last, so the edge values above can't undo it:
+    // only MOV AX,[BX] and MOV [BX],AX are implemented
+    if(opcode == 0x8B || opcode == 0x89)
+    {
+        vector->code[1] = 0x07;
+    }
+}
+
+// Make a failing vector as simple as possible while it still fails:
+// each field is cleared if it can be, otherwise cleared a bit at a time
+// IP and the instruction bytes stay put when a translated block goes with them
+static void conformance_minimize(TestVector *vector, AotFunction aot)
+{
+    uint16_t *fields[] = { &vector->cpu.AX, &vector->cpu.BX, &vector->cpu.CX, &vector->cpu.DX,
+                           &vector->cpu.SI, &vector->cpu.DI, &vector->cpu.BP, &vector->cpu.SP,
+                           &vector->cpu.IP, &vector->cpu.CS, &vector->cpu.DS, &vector->cpu.ES,
+                           &vector->cpu.SS, &vector->cpu.FLAGS, &vector->data_bx, &vector->data_offset,
+                           &vector->stack };
+
+    for(size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        if(aot != NULL && fields[i] == &vector->cpu.IP)
+        {
+            continue;
+        }
+
+        for(int bit = 15; bit >= -1; bit--)
+        {
+            uint16_t old = *fields[i];
+            *fields[i] = bit < 0 ? 0 : old & ~(1 << bit);
+
+            if(*fields[i] == old || conformance_run(vector, aot, NULL, 0) == 0)
+            {
+                *fields[i] = old;
+            }
+            else if(bit < 0)
+            {
+                break;
+            }
+        }
+    }
+
+    for(int i = 1; i < 3 && aot == NULL; i++)
+    {
+        uint8_t old = vector->code[i];
+        vector->code[i] = 0;
+
+        if(conformance_run(vector, aot, NULL, 0) == 0)
+        {
+            vector->code[i] = old;
+        }
+    }
+}
+
+static void conformance_format(const TestVector *vector, char *line, size_t size)
+{
+    const CPU16 *c = &vector->cpu;
+
+    snprintf(line, size, PRINT_FORMAT, vector->code[0], vector->code[1], vector->code[2],
+        c->AX, c->BX, c->CX, c->DX, c->SI, c->DI, c->BP, c->SP, c->IP, c->CS, c->DS, c->ES, c->SS, c->FLAGS,
+        vector->data_bx, vector->data_offset, vector->stack);
+}
+
+// One worker's share of the vectors: every vector i where i % workers == worker
+// When there is an AOT library half the vectors take their IP and instruction
+// from one of the translated templates and go through the AOT leg as well
+// Returns the number that failed
+static uint64_t conformance_worker(int worker, int workers, uint64_t vectors, uint64_t seed,
+                                   const TestVector *templates, const AotBlock *blocks)
+{
+    int opcodes = sizeof(conformance_opcodes) / sizeof(conformance_opcodes[0]);
+    CPU16 cpu = {0};
+    uint64_t failed = 0;
+    static char report[4096];
+
+    fuzz_random_state = seed ^ ((uint64_t)(worker + 1) * 0xD1B54A32D192ED03ull);
+    snapshot_take(&cpu);
+
+    for(int o = 0; o < opcodes; o++)
+    {
+        int reported = 0;
+
+        for(uint64_t i = worker; i < vectors; i += workers)
+        {
+            TestVector vector;
+            AotFunction aot = NULL;
+            conformance_random(&vector, conformance_opcodes[o]);
+
+            if(blocks != NULL && fuzz_random(2) == 0)
+            {
+                int t = o * CONFORMANCE_AOT_TEMPLATES + fuzz_random(CONFORMANCE_AOT_TEMPLATES);
+
+                vector.cpu.IP = templates[t].cpu.IP;
+                memcpy(vector.code, templates[t].code, sizeof(vector.code));
+                aot = blocks[t].function;
+            }
+
+            if(conformance_run(&vector, aot, NULL, 0) == 0)
+            {
+                continue;
+            }
+
+            failed++;
+
+            if(!reported)
+            {
+                reported = 1;
+                conformance_minimize(&vector, aot);
+
+                char line[256];
+                conformance_format(&vector, line, sizeof(line));
+                snprintf(report, sizeof(report), "FAIL opcode %02X: --replay \"%s\"\n", conformance_opcodes[o], line);
+                conformance_run(&vector, aot, report, sizeof(report));
+
+                // One write so workers don't interleave
+                if(write(1, report, strlen(report)) < 0)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    return failed;
+}
+
+// Run every opcode against `vectors` random states, split across one process per core
+// Prints a minimized --replay line for the first failure each worker finds per opcode
+// Returns the number of failing vectors
+int conformance(uint64_t vectors)
+{
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int opcodes = sizeof(conformance_opcodes) / sizeof(conformance_opcodes[0]);
+    uint64_t seed = (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ull;
+    time_t started = time(NULL);
+    uint64_t failed = 0;
+
+    if(workers < 1)
+    {
+        workers = 1;
+    }
+
+    int (*results)[2] = (int (*)[2])malloc(workers * sizeof(*results));
+    int *forked = (int *)calloc(workers, sizeof(int));
+
+    #if DEBUG
+    printf("Warning: conformance testing with DEBUG output on, build with -DDEBUG=0\n");
+    #endif
+
+    printf("Conformance: %d opcodes x %llu vectors on %d workers (seed %016llX)\n",
+        opcodes, (unsigned long long)vectors, workers, (unsigned long long)seed);
+    fflush(stdout);
+
+    // Instructions for the AOT leg, compiled once and shared by every worker
+    int template_count = opcodes * CONFORMANCE_AOT_TEMPLATES;
+    TestVector *templates = (TestVector *)malloc(template_count * sizeof(TestVector));
+
+    fuzz_random_state = seed;
+    for(int i = 0; i < template_count; i++)
+    {
+        conformance_random(&templates[i], conformance_opcodes[i / CONFORMANCE_AOT_TEMPLATES]);
+    }
+
+    const AotBlock *blocks = conformance_build_aot(templates, template_count);
+
+    if(blocks != NULL)
+    {
+        printf("AOT leg: %d translated instructions\n", template_count);
+    }
+    else
+    {
+        printf("No C compiler found (set CC), skipping the AOT leg\n");
+    }
+    fflush(stdout);
+
+    for(int w = 0; w < workers; w++)
+    {
+        // Out of descriptors: run this share in the parent like a failed fork
+        if(pipe(results[w]) < 0)
+        {
+            perror("pipe");
+            continue;
+        }
+
+        pid_t pid = fork();
+
+        if(pid == 0)
+        {
+            // Worker: its own copy of memory thanks to fork
+            uint64_t count = conformance_worker(w, workers, vectors, seed, templates, blocks);
+
+            if(write(results[w][1], &count, sizeof(count)) < 0)
+            {
+                _exit(2);
+            }
+            _exit(0);
+        }
+
+        close(results[w][1]);
+
+        if(pid < 0)
+        {
+            perror("fork");
+            close(results[w][0]);
+        }
+        else
+        {
+            forked[w] = 1;
+        }
+    }
+
+    // Anything we couldn't fork a worker for gets run here
+    // (after the forks, so the workers start from a clean machine)
+    for(int w = 0; w < workers; w++)
+    {
+        if(!forked[w])
+        {
+            failed += conformance_worker(w, workers, vectors, seed, templates, blocks);
+        }
+    }
+
+    for(int w = 0; w < workers; w++)
+    {
+        uint64_t count = 0;
+
+        if(!forked[w])
+        {
+            continue;
+        }
+
+        if(read(results[w][0], &count, sizeof(count)) != sizeof(count))
+        {
+            printf("Worker %d died\n", w);
+            count = 1;
+        }
+
+        close(results[w][0]);
+        failed += count;
+    }
+
+    while(wait(NULL) > 0)
+    {
+    }
+
+    free(results);
+    free(forked);
+    free(templates);
+
+    time_t seconds = time(NULL) - started;
+    printf("%llu of %llu vectors failed in %llds\n",
+        (unsigned long long)failed, (unsigned long long)vectors * opcodes, (long long)seconds);
+
+    return failed > 0;
+}
+
+// Run a single vector printed by a failing conformance run
+// The vector's instruction is translated on its own for the AOT leg
+// The interpreter's own DEBUG output shows what it did
+int conformance_replay(const char *line)
+{
+    TestVector vector = {};
+    CPU16 cpu = {0};
+    CPU16 *c = &vector.cpu;
+    static char report[4096];
+
+    if(sscanf(line, REPLAY_FORMAT, &vector.code[0], &vector.code[1], &vector.code[2],
+        &c->AX, &c->BX, &c->CX, &c->DX, &c->SI, &c->DI, &c->BP, &c->SP, &c->IP, &c->CS, &c->DS, &c->ES, &c->SS, &c->FLAGS,
+        &vector.data_bx, &vector.data_offset, &vector.stack) != 20)
+    {
+        printf("Can't parse vector: %s\n", line);
+        return -1;
+    }
+
+    c->running = 1;
+
+    const AotBlock *blocks = conformance_build_aot(&vector, 1);
+    if(blocks == NULL)
+    {
+        printf("No C compiler found (set CC), skipping the AOT leg\n");
+    }
+
+    snapshot_take(&cpu);
+
+    int differences = conformance_run(&vector, blocks != NULL ? blocks[0].function : NULL, report, sizeof(report));
+    printf("%s%d difference(s)\n", report, differences);
+
+    return differences;
+}